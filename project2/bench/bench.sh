@@ -0,0 +1,192 @@
+#!/usr/bin/env bash
+#
+# Compile-time and code-quality benchmark for p2.
+#
+# Every input (.bc or .ll) is optimized several ways:
+#   none        p2 -no-cse (reference, unoptimized)
+#   p2          p2
+#   p2-m2r      p2 -mem2reg
+#   p2-merge    p2 -mem2reg -merge-functions
+#   opt         opt -passes=early-cse,gvn
+#   opt-m2r     opt -passes=mem2reg,early-cse,gvn
+#
+# For each result we record compile wall time, peak memory, the
+# instruction/load/store counts reported by p2's summarize(), and the
+# native run time and .text size of the program built with llc and the
+# local C compiler.
+# Results go to stdout as a table and to a CSV file. When a baseline CSV
+# from an earlier run is given, rows whose compile or run time grew by more
+# than the threshold are reported and the script exits with status 2.
+#
+# USAGE: bench.sh [-o results.csv] [-b baseline.csv] [-t percent] [-r runs]
+#                 <path to p2> <corpus dir or files>...
+#
+# Environment: OPT, LLC, CC override the tools used.
+
+set -u
+
+OPT=${OPT:-opt}
+LLC=${LLC:-llc}
+CC=${CC:-cc}
+
+RESULTS=bench_results.csv
+BASELINE=
+THRESHOLD=10
+RUNS=3
+
+# the header comment above
+usage() {
+    sed -n '3,/^$/s/^# \{0,1\}//p' "$0"
+    exit 1
+}
+
+while getopts "o:b:t:r:h" flag; do
+    case $flag in
+        o) RESULTS=$OPTARG ;;
+        b) BASELINE=$OPTARG ;;
+        t) THRESHOLD=$OPTARG ;;
+        r) RUNS=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -lt 2 ]; then
+    usage
+fi
+
+P2=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+
+INPUTS=()
+for arg in "$@"; do
+    if [ -d "$arg" ]; then
+        for f in "$arg"/*.bc "$arg"/*.ll; do
+            [ -e "$f" ] && INPUTS+=("$f")
+        done
+    else
+        INPUTS+=("$arg")
+    fi
+done
+
+if [ ${#INPUTS[@]} -eq 0 ]; then
+    echo "bench.sh: no .bc or .ll inputs found" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# now in seconds with nanosecond resolution
+now() {
+    date +%s.%N
+}
+
+# run a compile command, leaving "<wall seconds> <peak KB>" in $WORK/measure
+measure() {
+    if [ -x /usr/bin/time ]; then
+        /usr/bin/time -f "%e %M" -o "$WORK/measure" "$@" >/dev/null 2>"$WORK/err"
+    else
+        local start end
+        start=$(now)
+        "$@" >/dev/null 2>"$WORK/err"
+        local status=$?
+        end=$(now)
+        echo "$(echo "$end - $start" | awk '{ printf "%.3f", $1 - $3 }') n/a" > "$WORK/measure"
+        return $status
+    fi
+}
+
+# value of a stat from a p2 .stats file, 0 if absent
+stat_value() {
+    local v
+    v=$(grep "^$2," "$1" 2>/dev/null | cut -d, -f2)
+    echo "${v:-0}"
+}
+
+# best of $RUNS native runs, output left in $WORK/run.out
+run_native() {
+    local exe=$1 best=
+    for _ in $(seq "$RUNS"); do
+        local start end t
+        start=$(now)
+        "$exe" </dev/null >"$WORK/run.out" 2>/dev/null
+        end=$(now)
+        t=$(echo "$start $end" | awk '{ printf "%.4f", $2 - $1 }')
+        if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then
+            best=$t
+        fi
+    done
+    echo "$best"
+}
+
+echo "input,variant,compile_s,peak_kb,instructions,loads,stores,run_s,output,text_bytes" > "$RESULTS"
+
+for input in "${INPUTS[@]}"; do
+    name=$(basename "$input")
+    name=${name%.*}
+
+    for variant in none p2 p2-m2r p2-merge opt opt-m2r; do
+        out=$WORK/$name.$variant.bc
+        case $variant in
+            none)    measure "$P2" -no-cse "$input" "$out" ;;
+            p2)      measure "$P2" "$input" "$out" ;;
+            p2-m2r)  measure "$P2" -mem2reg "$input" "$out" ;;
+            p2-merge) measure "$P2" -mem2reg -merge-functions "$input" "$out" ;;
+            opt)     measure "$OPT" -passes=early-cse,gvn "$input" -o "$out" ;;
+            opt-m2r) measure "$OPT" -passes=mem2reg,early-cse,gvn "$input" -o "$out" ;;
+        esac
+        if [ $? -ne 0 ]; then
+            echo "$name,$variant,fail,,,,,,," >> "$RESULTS"
+            continue
+        fi
+        read -r wall peak < "$WORK/measure"
+
+        # opt does not write p2 statistics; summarize its output with p2
+        if [ ! -f "$out.stats" ]; then
+            "$P2" -no-cse "$out" "$WORK/summary.bc" >/dev/null 2>&1
+            cp "$WORK/summary.bc.stats" "$out.stats" 2>/dev/null
+        fi
+        insts=$(stat_value "$out.stats" Instructions)
+        loads=$(stat_value "$out.stats" Loads)
+        stores=$(stat_value "$out.stats" Stores)
+
+        runtime=n/a
+        output=n/a
+        text=n/a
+        if "$LLC" -O2 -relocation-model=pic "$out" -o "$WORK/$name.s" 2>/dev/null &&
+           "$CC" "$WORK/$name.s" -o "$WORK/$name.exe" -lm 2>/dev/null; then
+            text=$(size -A "$WORK/$name.exe" 2>/dev/null | awk '$1 == ".text" { print $2 }')
+            runtime=$(run_native "$WORK/$name.exe")
+            if [ $variant = none ]; then
+                cp "$WORK/run.out" "$WORK/$name.expected"
+                output=ref
+            elif cmp -s "$WORK/run.out" "$WORK/$name.expected"; then
+                output=ok
+            else
+                output=DIFF
+            fi
+        fi
+
+        echo "$name,$variant,$wall,$peak,$insts,$loads,$stores,$runtime,$output,${text:-n/a}" >> "$RESULTS"
+    done
+done
+
+column -s, -t < "$RESULTS" 2>/dev/null || tr , '\t' < "$RESULTS"
+
+if [ -n "$BASELINE" ]; then
+    awk -F, -v limit="$THRESHOLD" '
+        NR == FNR { if (FNR > 1) { compile[$1 "," $2] = $3; run[$1 "," $2] = $8 }; next }
+        FNR == 1 { next }
+        {
+            key = $1 "," $2
+            if ((key in compile) && compile[key] + 0 > 0 && $3 + 0 > compile[key] * (1 + limit / 100)) {
+                printf "REGRESSION %s compile time %ss -> %ss\n", key, compile[key], $3; bad = 1
+            }
+            if ((key in run) && run[key] + 0 > 0 && $8 + 0 > run[key] * (1 + limit / 100)) {
+                printf "REGRESSION %s run time %ss -> %ss\n", key, run[key], $8; bad = 1
+            }
+        }
+        END { exit bad ? 2 : 0 }' "$BASELINE" "$RESULTS"
+    exit $?
+fi
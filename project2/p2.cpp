@@ -1,3 +1,4 @@
+#include <chrono>
 #include <fstream>
 #include <memory>
 #include <algorithm>
@@ -8,6 +9,7 @@
 
 #include "llvm-c/Core.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Verifier.h"
@@ -17,6 +19,10 @@
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_os_ostream.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/Casting.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/FileSystem.h"
@@ -25,14 +31,31 @@
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/FunctionComparator.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
 
 using namespace llvm;
 using namespace std;
 
 static void CommonSubexpressionElimination(Module *);
+static void MergeIdenticalFunctions(Module *);
 
 static void summarize(Module *M);
 static void print_csv_file(std::string outputfile);
+static void print_json_file(std::string outputfile);
+
+// What CommonSubexpressionElimination did to one function, kept for the
+// json stats format
+struct FunctionStats {
+    std::string Name;
+    unsigned InstsBefore = 0;
+    unsigned InstsAfter = 0;
+    std::vector<std::pair<StringRef, uint64_t>> Eliminated;
+    std::vector<std::pair<StringRef, double>> Seconds;
+};
+static std::vector<FunctionStats> FuncStats;
 
 static cl::opt<std::string>
         InputFilename(cl::Positional, cl::desc("<input bitcode>"), cl::Required, cl::init("-"));
@@ -50,11 +73,36 @@ static cl::opt<bool>
               cl::desc("Do not perform CSE Optimization."),
               cl::init(false));
 
+static cl::opt<bool>
+        NoSCCP("no-sccp",
+               cl::desc("Do not perform sparse conditional constant propagation before CSE."),
+               cl::init(false));
+
+static cl::opt<bool>
+        MergeFuncs("merge-functions",
+                   cl::desc("Merge structurally identical functions after CSE."),
+                   cl::init(false));
+
 static cl::opt<bool>
         Verbose("verbose",
                     cl::desc("Verbose stats."),
                     cl::init(false));
 
+enum StatsFormat { CSVStats, JSONStats };
+
+static cl::opt<StatsFormat>
+        StatsFmt("stats-format",
+                 cl::desc("Format of the .stats file."),
+                 cl::values(clEnumValN(CSVStats, "csv", "name,value lines"),
+                            clEnumValN(JSONStats, "json", "module and per-function stats with phase timing")),
+                 cl::init(CSVStats));
+
+static cl::opt<std::string>
+        CacheDir("cse-cache",
+                 cl::desc("Directory of previously optimized functions; unchanged functions are reused from it."),
+                 cl::value_desc("dir"),
+                 cl::init(""));
+
 static cl::opt<bool>
         NoCheck("no",
                 cl::desc("Do not check for valid IR."),
@@ -101,9 +149,16 @@ int main(int argc, char **argv) {
         CommonSubexpressionElimination(M.get());
     }
 
+    if (MergeFuncs) {
+        MergeIdenticalFunctions(M.get());
+    }
+
     // Collect statistics on Module
     summarize(M.get());
-    print_csv_file(OutputFilename);
+    if (StatsFmt == JSONStats)
+        print_json_file(OutputFilename);
+    else
+        print_csv_file(OutputFilename);
 
     if (Verbose)
         PrintStatistics(errs());
@@ -158,12 +213,322 @@ static void print_csv_file(std::string outputfile)
     stats.close();
 }
 
+static void print_json_file(std::string outputfile)
+{
+    std::ofstream stats(outputfile + ".stats");
+    raw_os_ostream os(stats);
+    json::OStream J(os, 2);
+    J.object([&] {
+        J.attributeObject("statistics", [&] {
+            for (auto p : GetStatistics())
+                J.attribute(p.first, (int64_t)p.second);
+        });
+        J.attributeArray("functions", [&] {
+            for (auto &FS : FuncStats) {
+                J.object([&] {
+                    J.attribute("name", FS.Name);
+                    J.attribute("instructions_before", FS.InstsBefore);
+                    J.attribute("instructions_after", FS.InstsAfter);
+                    J.attributeObject("eliminated", [&] {
+                        for (auto &e : FS.Eliminated)
+                            J.attribute(e.first, e.second);
+                    });
+                    J.attributeObject("seconds", [&] {
+                        for (auto &t : FS.Seconds)
+                            J.attribute(t.first, t.second);
+                    });
+                });
+            }
+        });
+    });
+    os << "\n";
+}
+
 static llvm::Statistic CSEDead = {"", "CSEDead", "CSE found dead instructions"};
 static llvm::Statistic CSEElim = {"", "CSEElim", "CSE redundant instructions"};
 static llvm::Statistic CSESimplify = {"", "CSESimplify", "CSE simplified instructions"};
 static llvm::Statistic CSELdElim = {"", "CSELdElim", "CSE redundant loads"};
 static llvm::Statistic CSEStore2Load = {"", "CSEStore2Load", "CSE forwarded store to load"};
 static llvm::Statistic CSEStElim = {"", "CSEStElim", "CSE redundant stores"};
+static llvm::Statistic SCCPConst = {"", "SCCPConst", "SCCP instructions folded to constants"};
+static llvm::Statistic SCCPBranch = {"", "SCCPBranch", "SCCP conditional branches folded"};
+static llvm::Statistic SCCPDeadBlocks = {"", "SCCPDeadBlocks", "SCCP unreachable blocks removed"};
+static llvm::Statistic SCCPDeadInst = {"", "SCCPDeadInst", "SCCP instructions removed with unreachable blocks"};
+
+/*
+Sparse conditional constant propagation (Wegman & Zadeck).
+
+Every instruction starts out Unknown and can only move down the lattice
+Unknown -> Const -> Over. Blocks are only visited once some CFG edge into
+them is known to be executable, and a conditional branch on a constant
+only makes one of its edges executable, so constants flow through PHIs
+and across blocks that DeadInstRemoval's simplifyInstruction never sees.
+Afterwards constant instructions are replaced, branches on constants
+become unconditional and blocks that were never reached are deleted.
+*/
+struct LatticeVal {
+    enum State { Unknown, Const, Over } state = Unknown;
+    Constant *C = nullptr;
+
+    bool operator!=(const LatticeVal &o) const { return state != o.state || C != o.C; }
+};
+
+struct ConstPropSolver {
+    const DataLayout &DL;
+    DenseMap<Value*, LatticeVal> values;
+    SmallPtrSet<BasicBlock*, 32> executable;
+    std::set<std::pair<BasicBlock*, BasicBlock*>> edges;
+    std::vector<Instruction*> worklist;
+
+    ConstPropSolver(const DataLayout &DL) : DL(DL) {}
+
+    LatticeVal get(Value *V) {
+        LatticeVal lv;
+        if (Constant *C = dyn_cast<Constant>(V)) {
+            lv.state = LatticeVal::Const;
+            lv.C = C;
+        } else if (isa<Instruction>(V)) {
+            lv = values.lookup(V);
+        } else {
+            lv.state = LatticeVal::Over; // arguments
+        }
+        return lv;
+    }
+
+    void set(Instruction *I, LatticeVal lv) {
+        if (!(values[I] != lv))
+            return;
+        values[I] = lv;
+        for (User *U : I->users()) {
+            Instruction *UI = cast<Instruction>(U);
+            if (executable.count(UI->getParent()))
+                worklist.push_back(UI);
+        }
+    }
+
+    void set_over(Instruction *I) {
+        LatticeVal lv;
+        lv.state = LatticeVal::Over;
+        set(I, lv);
+    }
+
+    void set_const(Instruction *I, Constant *C) {
+        LatticeVal lv;
+        lv.state = LatticeVal::Const;
+        lv.C = C;
+        set(I, lv);
+    }
+
+    void mark_edge(BasicBlock *From, BasicBlock *To) {
+        if (!edges.insert({From, To}).second)
+            return;
+        if (executable.insert(To).second) {
+            for (auto &I : *To)
+                worklist.push_back(&I);
+        } else {
+            // a new way into To, its PHIs may change
+            for (PHINode &phi : To->phis())
+                worklist.push_back(&phi);
+        }
+    }
+
+    void visit_phi(PHINode *phi) {
+        LatticeVal merged;
+        for (unsigned i = 0; i < phi->getNumIncomingValues(); i++) {
+            if (!edges.count({phi->getIncomingBlock(i), phi->getParent()}))
+                continue;
+            LatticeVal in = get(phi->getIncomingValue(i));
+            if (in.state == LatticeVal::Unknown)
+                continue;
+            if (in.state == LatticeVal::Over ||
+                (merged.state == LatticeVal::Const && merged.C != in.C)) {
+                set_over(phi);
+                return;
+            }
+            merged = in;
+        }
+        if (merged.state == LatticeVal::Const)
+            set_const(phi, merged.C);
+    }
+
+    void visit_terminator(Instruction *T) {
+        BasicBlock *BB = T->getParent();
+        Value *cond = nullptr;
+        if (BranchInst *BI = dyn_cast<BranchInst>(T)) {
+            if (BI->isConditional())
+                cond = BI->getCondition();
+        } else if (SwitchInst *SI = dyn_cast<SwitchInst>(T)) {
+            cond = SI->getCondition();
+        }
+
+        if (cond) {
+            LatticeVal lv = get(cond);
+            if (lv.state == LatticeVal::Unknown)
+                return;
+            ConstantInt *CI = dyn_cast_or_null<ConstantInt>(lv.C);
+            if (CI) {
+                if (BranchInst *BI = dyn_cast<BranchInst>(T))
+                    mark_edge(BB, BI->getSuccessor(CI->isZero() ? 1 : 0));
+                else
+                    mark_edge(BB, cast<SwitchInst>(T)->findCaseValue(CI)->getCaseSuccessor());
+                return;
+            }
+        }
+        for (BasicBlock *Succ : successors(BB))
+            mark_edge(BB, Succ);
+    }
+
+    void visit(Instruction *I) {
+        if (PHINode *phi = dyn_cast<PHINode>(I))
+            return visit_phi(phi);
+        if (I->isTerminator()) {
+            // the result of an invoke or callbr is not known
+            if (!I->getType()->isVoidTy())
+                set_over(I);
+            return visit_terminator(I);
+        }
+
+        bool foldable = isa<BinaryOperator>(I) || isa<UnaryOperator>(I) || isa<CastInst>(I) ||
+                        isa<CmpInst>(I) || isa<SelectInst>(I) || isa<GetElementPtrInst>(I) ||
+                        isa<ExtractValueInst>(I) || isa<InsertValueInst>(I) ||
+                        isa<ExtractElementInst>(I) || isa<InsertElementInst>(I) ||
+                        isa<ShuffleVectorInst>(I);
+        if (!foldable)
+            return set_over(I);
+
+        // a select on a known condition is whatever it selects
+        if (SelectInst *SI = dyn_cast<SelectInst>(I)) {
+            LatticeVal c = get(SI->getCondition());
+            if (ConstantInt *CI = dyn_cast_or_null<ConstantInt>(c.C)) {
+                LatticeVal chosen = get(CI->isZero() ? SI->getFalseValue() : SI->getTrueValue());
+                if (chosen.state != LatticeVal::Unknown)
+                    set(I, chosen);
+                return;
+            }
+        }
+
+        SmallVector<Constant*, 4> ops;
+        for (Value *op : I->operands()) {
+            LatticeVal lv = get(op);
+            if (lv.state == LatticeVal::Over)
+                return set_over(I);
+            if (lv.state == LatticeVal::Unknown)
+                return;
+            ops.push_back(lv.C);
+        }
+
+        Constant *folded;
+        if (CmpInst *CI = dyn_cast<CmpInst>(I))
+            folded = ConstantFoldCompareInstOperands(CI->getPredicate(), ops[0], ops[1], DL);
+        else
+            folded = ConstantFoldInstOperands(I, ops, DL);
+        if (folded)
+            set_const(I, folded);
+        else
+            set_over(I);
+    }
+
+    void solve(Function &F) {
+        BasicBlock *Entry = &F.getEntryBlock();
+        executable.insert(Entry);
+        for (auto &I : *Entry)
+            worklist.push_back(&I);
+
+        while (true) {
+            while (!worklist.empty()) {
+                Instruction *I = worklist.back();
+                worklist.pop_back();
+                visit(I);
+            }
+
+            // a branch on a value that never resolved (undef, say) may go
+            // either way
+            for (BasicBlock &BB : F) {
+                Instruction *T = BB.getTerminator();
+                if (!executable.count(&BB) || !T || T->getNumSuccessors() < 2)
+                    continue;
+                Value *cond = isa<BranchInst>(T) ? cast<BranchInst>(T)->getCondition()
+                                                 : isa<SwitchInst>(T) ? cast<SwitchInst>(T)->getCondition() : nullptr;
+                if (cond && get(cond).state == LatticeVal::Unknown) {
+                    for (BasicBlock *Succ : successors(&BB))
+                        mark_edge(&BB, Succ);
+                }
+            }
+            if (worklist.empty())
+                break;
+        }
+    }
+};
+
+static void SparseCondConstProp(Function &F) {
+    ConstPropSolver solver(F.getParent()->getDataLayout());
+    solver.solve(F);
+
+    // replace instructions proven constant
+    for (BasicBlock &BB : F) {
+        if (!solver.executable.count(&BB))
+            continue;
+        for (auto inst = BB.begin(); inst != BB.end();) {
+            Instruction &I = *inst++;
+            if (I.isTerminator() || I.getType()->isVoidTy())
+                continue;
+            LatticeVal lv = solver.get(&I);
+            if (lv.state == LatticeVal::Const) {
+                I.replaceAllUsesWith(lv.C);
+                I.eraseFromParent();
+                SCCPConst++;
+            }
+        }
+    }
+
+    // branches on constants keep only the edge they take
+    for (BasicBlock &BB : F) {
+        if (!solver.executable.count(&BB))
+            continue;
+        Instruction *T = BB.getTerminator();
+        BasicBlock *taken = nullptr;
+        if (BranchInst *BI = dyn_cast<BranchInst>(T)) {
+            if (BI->isConditional())
+                if (ConstantInt *CI = dyn_cast<ConstantInt>(BI->getCondition()))
+                    taken = BI->getSuccessor(CI->isZero() ? 1 : 0);
+        } else if (SwitchInst *SI = dyn_cast<SwitchInst>(T)) {
+            if (ConstantInt *CI = dyn_cast<ConstantInt>(SI->getCondition()))
+                taken = SI->findCaseValue(CI)->getCaseSuccessor();
+        }
+        if (!taken)
+            continue;
+
+        bool kept = false;
+        for (BasicBlock *Succ : successors(&BB)) {
+            if (Succ == taken && !kept)
+                kept = true;
+            else
+                Succ->removePredecessor(&BB);
+        }
+        BranchInst::Create(taken, T);
+        T->eraseFromParent();
+        SCCPBranch++;
+    }
+
+    // delete the blocks no executable edge leads to
+    std::vector<BasicBlock*> dead;
+    for (BasicBlock &BB : F) {
+        if (!solver.executable.count(&BB))
+            dead.push_back(&BB);
+    }
+    for (BasicBlock *BB : dead) {
+        for (BasicBlock *Succ : successors(BB)) {
+            if (solver.executable.count(Succ))
+                Succ->removePredecessor(BB);
+        }
+        SCCPDeadInst += BB->size();
+        BB->dropAllReferences();
+    }
+    for (BasicBlock *BB : dead) {
+        BB->eraseFromParent();
+        SCCPDeadBlocks++;
+    }
+}
 
 bool isDead(Instruction &I) {
     //process the received instruction to extract the opcode and compare it using switch statement
@@ -239,32 +604,28 @@ bool isDead(Instruction &I) {
   return false;
 }
 
-static void DeadInstRemoval(Module *M){
-  // looping over the functions inside a module
-  for(Module::iterator i = M->begin(); i!=M->end(); i++){
-    Function &Func = *i;
-    // looping over all the basic blocks in the function, F
-    for(Function::iterator j = Func.begin(); j != Func.end(); j++){
-      BasicBlock *bscblk = &*j;
-      for(BasicBlock::iterator k = bscblk->begin(); k != bscblk->end();){
-        Instruction &inst = *k;
-        //if instruction is dead, remove it from parent
-        //and increment CSEDead counter
-        if (isDead(inst)) {
-            k = inst.eraseFromParent();
-            CSEDead++;
-        } else {
-            //if instruction is not dead, simplify it, replace the uses
-            // and increment CSESimplify counter
-            Value *val = simplifyInstruction(&inst, M->getDataLayout());
-            if(val != NULL){
-              inst.replaceAllUsesWith(val);
-              CSESimplify++;
-              //remove later
-              
-            }
-            k++;
-        }
+static void DeadInstRemoval(Function &Func){
+  // looping over all the basic blocks in the function, F
+  for(Function::iterator j = Func.begin(); j != Func.end(); j++){
+    BasicBlock *bscblk = &*j;
+    for(BasicBlock::iterator k = bscblk->begin(); k != bscblk->end();){
+      Instruction &inst = *k;
+      //if instruction is dead, remove it from parent
+      //and increment CSEDead counter
+      if (isDead(inst)) {
+          k = inst.eraseFromParent();
+          CSEDead++;
+      } else {
+          //if instruction is not dead, simplify it, replace the uses
+          // and increment CSESimplify counter
+          Value *val = simplifyInstruction(&inst, Func.getParent()->getDataLayout());
+          if(val != NULL){
+            inst.replaceAllUsesWith(val);
+            CSESimplify++;
+            //remove later
+            
+          }
+          k++;
       }
     }
   }
@@ -317,52 +678,50 @@ static void global_CSE(BasicBlock *bb, Instruction *Inst_in){
 }
 
 // int glob_counter = 0;
-static void local_CSE(Module *M){
+static void local_CSE(Function &func){
     bool isRestrictedInst; //dont perform CSE on these instructions
 
-    for(auto &func : *M){
-        for(auto &basicblock : func){
-            
-            for(auto inst = basicblock.begin(); inst != basicblock.end(); inst++){
-                isRestrictedInst = false;
-                //check if the inst is load, store, branch, phi, return, call. 
-                //If yes, we need to ignore them for CSE
-                if( (isa<LoadInst>(*inst)) || (isa<AllocaInst>(*inst))  || (isa<StoreInst>(*inst)) || (isa<ReturnInst>(*inst)) ||
-                    (isa<CallInst>(*inst)) || (isa<PHINode>(*inst))     || (isa<BranchInst>(*inst)) ) {
-                        isRestrictedInst = true;
-                }
+    for(auto &basicblock : func){
+        
+        for(auto inst = basicblock.begin(); inst != basicblock.end(); inst++){
+            isRestrictedInst = false;
+            //check if the inst is load, store, branch, phi, return, call. 
+            //If yes, we need to ignore them for CSE
+            if( (isa<LoadInst>(*inst)) || (isa<AllocaInst>(*inst))  || (isa<StoreInst>(*inst)) || (isa<ReturnInst>(*inst)) ||
+                (isa<CallInst>(*inst)) || (isa<PHINode>(*inst))     || (isa<BranchInst>(*inst)) ) {
+                    isRestrictedInst = true;
+            }
 
-                if(isRestrictedInst){
-                    // glob_counter++;
-                    // errs() << ("glob counter = ") << glob_counter << " \n";
-                    continue;
-                }
-                else{
-                    auto next_inst = inst;
-                    next_inst++;
-                    //if there is an instruction that is identical to the one
-                    //received by this function, then replace the uses of the 
-                    //instruction in 'this' basic block and increment the CSEElim counter 
-                    std::vector<Instruction*> tobe_deleted;
-                    for(; next_inst != basicblock.end(); next_inst++){
-                        if((*next_inst).isIdenticalTo(&*inst)){
-                            (*next_inst).replaceAllUsesWith(&(*inst));
-                            //inst has been replaced, can be removed from parent
-                            //on the safe side, added it to a vector to be deleted later
-                            tobe_deleted.push_back(&(*next_inst));
-                        }
+            if(isRestrictedInst){
+                // glob_counter++;
+                // errs() << ("glob counter = ") << glob_counter << " \n";
+                continue;
+            }
+            else{
+                auto next_inst = inst;
+                next_inst++;
+                //if there is an instruction that is identical to the one
+                //received by this function, then replace the uses of the 
+                //instruction in 'this' basic block and increment the CSEElim counter 
+                std::vector<Instruction*> tobe_deleted;
+                for(; next_inst != basicblock.end(); next_inst++){
+                    if((*next_inst).isIdenticalTo(&*inst)){
+                        (*next_inst).replaceAllUsesWith(&(*inst));
+                        //inst has been replaced, can be removed from parent
+                        //on the safe side, added it to a vector to be deleted later
+                        tobe_deleted.push_back(&(*next_inst));
                     }
+                }
 
-                    for(auto inst_iter: tobe_deleted){
-                        //erase from parent and increment CSEElim
-                        inst_iter->eraseFromParent();
-                        CSEElim++;
-                    }
-                    //pass this instruction and basicblock to global_CSE
-                    //in order to recursively remove any occurences of inst
-                    //throughout the module
-                    global_CSE(&basicblock, &(*inst));
+                for(auto inst_iter: tobe_deleted){
+                    //erase from parent and increment CSEElim
+                    inst_iter->eraseFromParent();
+                    CSEElim++;
                 }
+                //pass this instruction and basicblock to global_CSE
+                //in order to recursively remove any occurences of inst
+                //throughout the module
+                global_CSE(&basicblock, &(*inst));
             }
         }
     }
@@ -384,137 +743,576 @@ for each load, L:
             break (stop considering load L, move on)
 */
 
-static void elim_red_loads(Module* M){
-    for(auto &func : *M){
-        for(auto &basicblock : func){     
-                   
-            for(auto inst = basicblock.begin(); inst != basicblock.end(); inst++){
-                //(*inst).print(errs() << "\n");
-
-                //check if load
-                if((isa<LoadInst>(*inst))){
-                    bool LoadMatchDetected = false;
-                    // errs() << "\nIs a load instruction\n";
-                    //find address of load inst
-                    Value* val1 = inst->getOperand(0);
-                    auto next_inst = inst;
-                    next_inst++;
-                    std::vector<Instruction*> inst_tobe_deleted;
-                    for(; next_inst != basicblock.end(); next_inst++){
-                        //if inst is store or call, can it and move on
-                        if( (isa<StoreInst>(*next_inst)) || (isa<CallInst>(*next_inst)) ){
-                            //stop considering inst altogether
-                            //errs() << "\t\tstop considering inst altogether\n" ;
-                            //(*next_inst).print(errs() << "\n");
-                            break;
-                        }
-                        
-                        //later inst is load, NOT volatile, has same address and has same type (phew!! what a relief!)
-                        if( ( isa<LoadInst>(*next_inst) ) && ( (*next_inst).isVolatile() == false ) && 
-                            ( (*inst).getType() == (*next_inst).getType() ) ) {
-                            //Replace all uses of next_inst with inst
-                            Value* val2 = next_inst->getOperand(0);
-                            if(val1 == val2){
-                                (*next_inst).replaceAllUsesWith(&(*inst));
-                                //Erase next_inst
-                                inst_tobe_deleted.push_back((&*next_inst));
-                                //increment countter CSELdElim
-                                CSELdElim++;
-                                //set this flag to remove instructions from vector later on
-                                LoadMatchDetected = true;
-                            }
-                        }
-                        else
-                            continue;
-                    }//end of checking if the instructions after the detected load 'could be' a match for elimination 
-                        //delete all redundantinstructions
-                    if(LoadMatchDetected == true){
-                        for(auto inst_iter: inst_tobe_deleted){
-                            inst_iter->eraseFromParent();
+static void elim_red_loads(Function &func){
+    for(auto &basicblock : func){     
+               
+        for(auto inst = basicblock.begin(); inst != basicblock.end(); inst++){
+            //(*inst).print(errs() << "\n");
+
+            //check if load
+            if((isa<LoadInst>(*inst))){
+                bool LoadMatchDetected = false;
+                // errs() << "\nIs a load instruction\n";
+                //find address of load inst
+                Value* val1 = inst->getOperand(0);
+                auto next_inst = inst;
+                next_inst++;
+                std::vector<Instruction*> inst_tobe_deleted;
+                for(; next_inst != basicblock.end(); next_inst++){
+                    //if inst is store or call, can it and move on
+                    if( (isa<StoreInst>(*next_inst)) || (isa<CallInst>(*next_inst)) ){
+                        //stop considering inst altogether
+                        //errs() << "\t\tstop considering inst altogether\n" ;
+                        //(*next_inst).print(errs() << "\n");
+                        break;
+                    }
+                    
+                    //later inst is load, NOT volatile, has same address and has same type (phew!! what a relief!)
+                    if( ( isa<LoadInst>(*next_inst) ) && ( (*next_inst).isVolatile() == false ) && 
+                        ( (*inst).getType() == (*next_inst).getType() ) ) {
+                        //Replace all uses of next_inst with inst
+                        Value* val2 = next_inst->getOperand(0);
+                        if(val1 == val2){
+                            (*next_inst).replaceAllUsesWith(&(*inst));
+                            //Erase next_inst
+                            inst_tobe_deleted.push_back((&*next_inst));
+                            //increment countter CSELdElim
+                            CSELdElim++;
+                            //set this flag to remove instructions from vector later on
+                            LoadMatchDetected = true;
                         }
                     }
+                    else
+                        continue;
+                }//end of checking if the instructions after the detected load 'could be' a match for elimination 
+                    //delete all redundantinstructions
+                if(LoadMatchDetected == true){
+                    for(auto inst_iter: inst_tobe_deleted){
+                        inst_iter->eraseFromParent();
+                    }
                 }
-            }//end of instruction iteration in the basic block
-        }//end of block iteration within a function
-    }//end of function iteration within a module
+            }
+        }//end of instruction iteration in the basic block
+    }//end of block iteration within a function
 }
 
-static void elim_red_store(Module* M){
-    for(auto &func : *M){
-        for(auto &basicblock : func){
-            for(auto inst = basicblock.begin(); inst != basicblock.end(); inst++){
-                
-                bool StoreMatchDetected = false;
-                if((isa<StoreInst>(*inst))){// S , earlier store instn in program order
-                    StoreMatchDetected = false;
-                    //typecast inst as StoreInst
-                    StoreInst *s_inst = dyn_cast<StoreInst>(inst);
-                    auto next_inst = inst;
-                    next_inst++;//R
-                    std::vector<Instruction*> inst_tobe_deleted;
-                    for(; next_inst != basicblock.end(); next_inst++){
-                        
-                        //if  R is a load   &&  R is not volatile
-                        if( ( isa<LoadInst>(*next_inst) ) && ( (*next_inst).isVolatile() == false ) ) {
-                            //get the address of instructions and their types, their operand's type
-                            LoadInst *r_inst            = dyn_cast<LoadInst>(next_inst);
-                            Value* s_addr               = s_inst->getOperand(0);
-                            llvm::Type* s_val_op_type   = s_inst->getOperand(0)->getType();
-                            Value* r_addr               = r_inst->getOperand(0);
-                            llvm::Type* r_type          = r_inst->getType();
-                            //(R’s load address is the same as S) && (type of r == type of s_inst's operand)
-                            if( (s_addr == r_addr) && (s_val_op_type == r_type) ){
-                                //replace r_inst's use with s_inst's operand
-                                (*r_inst).replaceAllUsesWith(s_inst->getOperand(1));
-                                //Erase next_inst
-                                inst_tobe_deleted.push_back((&*r_inst));
-                                //increment the counter for CSEStore2Load
-                                CSEStore2Load++;
-                                StoreMatchDetected = true;
-                                continue;//seems irrelevant
-                            }
-                        }
-                        //Could not do this properly so commented it out
-                            // else if(( isa<StoreInst>(*next_inst) ) && ( (*inst).isVolatile() == false )){
-                            //     StoreInst *r_inst   = dyn_cast<StoreInst>(next_inst);
-                            //     Value* r_addr       = r_inst->getOperand(0);
-                            //     Value* s_addr       = s_inst->getOperand(0);
-                            //     llvm::Type* r_val_op_type   = r_inst->getOperand(0)->getType();
-                            //     llvm::Type* s_val_op_type   = s_inst->getOperand(0)->getType();
-                            //     if( (r_addr == s_addr) && (r_val_op_type == s_val_op_type)){
-                            //         inst_tobe_deleted.push_back((&*s_inst));
-                            //         CSEStElim++;
-                            //         StoreMatchDetected = true;
-                            //         break;
-                            //     }
-                            // }
-                            // Does not work properly so commented it out
-                        else {//if(( isa<LoadInst>(*next_inst) ) || ( isa<StoreInst>(*next_inst) ) || ( isa<CallInst>(*next_inst) )){
-                            // CSEStElim++;
-                            break;
-                        }
-                    }//1 store found, checking other inst
-                    //delete the instruction
-                    if(StoreMatchDetected == true){
-                        for(auto inst_iter: inst_tobe_deleted){
-                            CSEStElim++;
-                            inst_iter->eraseFromParent();
+static void elim_red_store(Function &func){
+    for(auto &basicblock : func){
+        for(auto inst = basicblock.begin(); inst != basicblock.end(); inst++){
+            
+            bool StoreMatchDetected = false;
+            if((isa<StoreInst>(*inst))){// S , earlier store instn in program order
+                StoreMatchDetected = false;
+                //typecast inst as StoreInst
+                StoreInst *s_inst = dyn_cast<StoreInst>(inst);
+                auto next_inst = inst;
+                next_inst++;//R
+                std::vector<Instruction*> inst_tobe_deleted;
+                for(; next_inst != basicblock.end(); next_inst++){
+                    
+                    //if  R is a load   &&  R is not volatile
+                    if( ( isa<LoadInst>(*next_inst) ) && ( (*next_inst).isVolatile() == false ) ) {
+                        //get the address of instructions and their types, their operand's type
+                        LoadInst *r_inst            = dyn_cast<LoadInst>(next_inst);
+                        Value* s_addr               = s_inst->getOperand(0);
+                        llvm::Type* s_val_op_type   = s_inst->getOperand(0)->getType();
+                        Value* r_addr               = r_inst->getOperand(0);
+                        llvm::Type* r_type          = r_inst->getType();
+                        //(R’s load address is the same as S) && (type of r == type of s_inst's operand)
+                        if( (s_addr == r_addr) && (s_val_op_type == r_type) ){
+                            //replace r_inst's use with s_inst's operand
+                            (*r_inst).replaceAllUsesWith(s_inst->getOperand(1));
+                            //Erase next_inst
+                            inst_tobe_deleted.push_back((&*r_inst));
+                            //increment the counter for CSEStore2Load
+                            CSEStore2Load++;
+                            StoreMatchDetected = true;
+                            continue;//seems irrelevant
                         }
                     }
+                    //Could not do this properly so commented it out
+                        // else if(( isa<StoreInst>(*next_inst) ) && ( (*inst).isVolatile() == false )){
+                        //     StoreInst *r_inst   = dyn_cast<StoreInst>(next_inst);
+                        //     Value* r_addr       = r_inst->getOperand(0);
+                        //     Value* s_addr       = s_inst->getOperand(0);
+                        //     llvm::Type* r_val_op_type   = r_inst->getOperand(0)->getType();
+                        //     llvm::Type* s_val_op_type   = s_inst->getOperand(0)->getType();
+                        //     if( (r_addr == s_addr) && (r_val_op_type == s_val_op_type)){
+                        //         inst_tobe_deleted.push_back((&*s_inst));
+                        //         CSEStElim++;
+                        //         StoreMatchDetected = true;
+                        //         break;
+                        //     }
+                        // }
+                        // Does not work properly so commented it out
+                    else {//if(( isa<LoadInst>(*next_inst) ) || ( isa<StoreInst>(*next_inst) ) || ( isa<CallInst>(*next_inst) )){
+                        // CSEStElim++;
+                        break;
+                    }
+                }//1 store found, checking other inst
+                //delete the instruction
+                if(StoreMatchDetected == true){
+                    for(auto inst_iter: inst_tobe_deleted){
+                        CSEStElim++;
+                        inst_iter->eraseFromParent();
+                    }
+                }
+
+            }
+
+        }//end of inst traversing withing the block
+    }//end of block traversing
+}
+
+static unsigned count_instructions(Function &F) {
+    unsigned n = 0;
+    for (auto &BB : F)
+        n += BB.size();
+    return n;
+}
+
+/*
+Incremental runs (-cse-cache=dir)
+
+Every function is copied into a module of its own that also declares the
+globals it refers to (constant globals keep their initializers, since
+simplifyInstruction may fold loads from them). The printed text of that
+module is the function's structural key: it covers the body, attributes,
+metadata, data layout and target, all numbered locally. The cache holds,
+per key, the optimized function in the same form (<key>.bc) and the
+counters CSE incremented for it (<key>.stats). On a hit the cached body is
+cloned over the function and the counters are replayed.
+
+Functions with debug info, unnamed globals, block addresses or metadata
+operands are always optimized normally.
+*/
+
+// bump when the optimization would give different results for the same input
+static const char *CacheVersion = "p2-cse-2";
+
+static llvm::Statistic CSECacheHit = {"", "CSECacheHit", "CSE functions reused from the cache"};
+static llvm::Statistic CSECacheMiss = {"", "CSECacheMiss", "CSE functions optimized and added to the cache"};
+
+// Cloning across modules leaves an empty llvm.dbg.cu behind, which the
+// bitcode reader warns about.
+static void drop_empty_dbg_cu(Module &M) {
+    if (NamedMDNode *CUs = M.getNamedMetadata("llvm.dbg.cu"))
+        if (CUs->getNumOperands() == 0)
+            M.eraseNamedMetadata(CUs);
+}
+
+static std::unique_ptr<Module> extract_function(Function &F) {
+    Module *M = F.getParent();
+    auto Dst = std::make_unique<Module>(F.getName(), M->getContext());
+    Dst->setDataLayout(M->getDataLayout());
+    Dst->setTargetTriple(M->getTargetTriple());
+
+    ValueToValueMapTy VMap;
+    Function *NewF = Function::Create(F.getFunctionType(), GlobalValue::ExternalLinkage, F.getName(), Dst.get());
+    VMap[&F] = NewF;
+
+    std::vector<Constant*> worklist;
+    std::vector<GlobalVariable*> constants;
+    SmallPtrSet<Constant*, 32> seen;
+    for (auto &BB : F) {
+        for (auto &I : BB) {
+            for (Value *op : I.operands()) {
+                if (isa<MetadataAsValue>(op) || isa<BlockAddress>(op))
+                    return nullptr;
+                if (isa<Constant>(op))
+                    worklist.push_back(cast<Constant>(op));
+            }
+        }
+    }
+    if (F.hasPersonalityFn())
+        worklist.push_back(F.getPersonalityFn());
+
+    // declare every global reachable through the constants F uses
+    while (!worklist.empty()) {
+        Constant *C = worklist.back();
+        worklist.pop_back();
+        if (!seen.insert(C).second || C == &F)
+            continue;
+        if (isa<BlockAddress>(C))
+            return nullptr;
+
+        if (GlobalValue *G = dyn_cast<GlobalValue>(C)) {
+            if (!G->hasName())
+                return nullptr;
+            GlobalVariable *GV = dyn_cast<GlobalVariable>(G);
+            if (G->getValueType()->isFunctionTy()) {
+                VMap[G] = Function::Create(cast<FunctionType>(G->getValueType()),
+                                           GlobalValue::ExternalLinkage, G->getName(), Dst.get());
+            } else {
+                bool constant = GV && GV->isConstant();
+                auto *NewGV = new GlobalVariable(*Dst, G->getValueType(), constant,
+                                                 GlobalValue::ExternalLinkage, nullptr, G->getName(),
+                                                 nullptr, G->getThreadLocalMode(), G->getAddressSpace());
+                VMap[G] = NewGV;
+                if (constant && GV->hasDefinitiveInitializer()) {
+                    constants.push_back(GV);
+                    worklist.push_back(GV->getInitializer());
+                }
+            }
+            continue;
+        }
+        for (Value *op : C->operands())
+            worklist.push_back(cast<Constant>(op));
+    }
+
+    for (GlobalVariable *GV : constants)
+        cast<GlobalVariable>(VMap[GV])->setInitializer(MapValue(GV->getInitializer(), VMap));
+
+    auto NewArg = NewF->arg_begin();
+    for (auto &Arg : F.args())
+        VMap[&Arg] = &*NewArg++;
+    SmallVector<ReturnInst*, 8> Returns;
+    CloneFunctionInto(NewF, &F, VMap, CloneFunctionChangeType::DifferentModule, Returns);
+    drop_empty_dbg_cu(*Dst);
+    return Dst;
+}
+
+static std::string cache_path(std::string key, const char *ext) {
+    SmallString<256> path(CacheDir.getValue());
+    sys::path::append(path, key + ext);
+    return std::string(path.str());
+}
+
+static std::string cache_key(Function &F) {
+    std::unique_ptr<Module> Extracted = extract_function(F);
+    if (!Extracted)
+        return "";
+
+    std::string text;
+    raw_string_ostream os(text);
+    os << CacheVersion << (NoSCCP ? " no-sccp" : "") << "\n";
+    Extracted->print(os, nullptr);
+    os.flush();
+
+    MD5 Hash;
+    Hash.update(text);
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    SmallString<32> key;
+    MD5::stringifyResult(Result, key);
+    return std::string(key.str());
+}
+
+// The cached module was read into the same context as M, so its named
+// struct types came back renamed (%struct.S -> %struct.S.0). Map each of
+// them to the module's type of the same name and layout.
+struct CacheTypeMapper : public ValueMapTypeRemapper {
+    LLVMContext &Ctx;
+    SmallPtrSet<Type*, 16> CachedTypes;
+    DenseMap<Type*, Type*> Mapped;
+    bool Failed = false;
+
+    CacheTypeMapper(Module &Cached) : Ctx(Cached.getContext()) {
+        for (StructType *ST : Cached.getIdentifiedStructTypes())
+            CachedTypes.insert(ST);
+    }
+
+    Type *remapType(Type *T) override {
+        auto it = Mapped.find(T);
+        if (it != Mapped.end())
+            return it->second;
+
+        if (CachedTypes.count(T))
+            return mapStruct(cast<StructType>(T));
+
+        SmallVector<Type*, 8> elems;
+        bool changed = false;
+        for (Type *E : T->subtypes()) {
+            elems.push_back(remapType(E));
+            changed |= elems.back() != E;
+        }
+        if (!changed)
+            return Mapped[T] = T;
+
+        Type *NewT = T;
+        if (auto *PT = dyn_cast<PointerType>(T))
+            NewT = PointerType::get(elems[0], PT->getAddressSpace());
+        else if (auto *AT = dyn_cast<ArrayType>(T))
+            NewT = ArrayType::get(elems[0], AT->getNumElements());
+        else if (auto *VT = dyn_cast<VectorType>(T))
+            NewT = VectorType::get(elems[0], VT->getElementCount());
+        else if (auto *FT = dyn_cast<FunctionType>(T))
+            NewT = FunctionType::get(elems[0], makeArrayRef(elems).drop_front(), FT->isVarArg());
+        else if (auto *ST = dyn_cast<StructType>(T))
+            NewT = StructType::get(Ctx, elems, ST->isPacked());
+        return Mapped[T] = NewT;
+    }
+
+    Type *mapStruct(StructType *ST) {
+        std::string name = ST->getName().str();
+        while (true) {
+            StructType *Candidate = StructType::getTypeByName(Ctx, name);
+            if (Candidate && !CachedTypes.count(Candidate) && sameLayout(ST, Candidate))
+                return Candidate;
+
+            // strip the ".N" the reader appended and try again
+            size_t dot = name.rfind('.');
+            if (dot == std::string::npos || dot + 1 == name.size() ||
+                name.find_first_not_of("0123456789", dot + 1) != std::string::npos) {
+                Failed = true;
+                return Mapped[ST] = ST;
+            }
+            name.resize(dot);
+        }
+    }
+
+    bool sameLayout(StructType *ST, StructType *Candidate) {
+        if (ST->isOpaque() != Candidate->isOpaque() || ST->isPacked() != Candidate->isPacked() ||
+            ST->getNumElements() != Candidate->getNumElements())
+            return false;
+        // assume the match while comparing, for recursive types
+        Mapped[ST] = Candidate;
+        for (unsigned i = 0; i < ST->getNumElements(); i++) {
+            if (remapType(ST->getElementType(i)) != Candidate->getElementType(i)) {
+                Mapped.erase(ST);
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Replace F's body by the cached one; false (and F untouched) on a miss.
+static bool cache_lookup(Function &F, std::string key, llvm::Statistic **Counters, unsigned nCounters) {
+    std::ifstream stats(cache_path(key, ".stats"));
+    if (!stats)
+        return false;
 
-            }//end of inst traversing withing the block
+    SMDiagnostic Err;
+    std::unique_ptr<Module> Cached = parseIRFile(cache_path(key, ".bc"), Err, F.getContext());
+    if (!Cached)
+        return false;
+    Function *CachedF = Cached->getFunction(F.getName());
+    if (!CachedF || CachedF->isDeclaration())
+        return false;
 
-            }//end of block traversing
-        }//end of function traversing withing module
+    // globals are matched up by name
+    Module *M = F.getParent();
+    ValueToValueMapTy VMap;
+    for (GlobalValue &G : Cached->global_values()) {
+        if (&G == CachedF)
+            continue;
+        GlobalValue *Local = M->getNamedValue(G.getName());
+        if (!Local || isa<Function>(Local) != isa<Function>(G))
+            return false;
+        VMap[&G] = Local;
     }
+    VMap[CachedF] = &F;
+
+    CacheTypeMapper TypeMapper(*Cached);
+    for (StructType *ST : Cached->getIdentifiedStructTypes())
+        TypeMapper.remapType(ST);
+    if (TypeMapper.Failed || TypeMapper.remapType(CachedF->getFunctionType()) != F.getFunctionType())
+        return false;
+
+    auto Arg = F.arg_begin();
+    for (auto &CachedArg : CachedF->args())
+        VMap[&CachedArg] = &*Arg++;
+
+    GlobalValue::LinkageTypes linkage = F.getLinkage();
+    F.deleteBody();
+    F.setLinkage(linkage);
+    SmallVector<ReturnInst*, 8> Returns;
+    CloneFunctionInto(&F, CachedF, VMap, CloneFunctionChangeType::DifferentModule, Returns,
+                      "", nullptr, &TypeMapper);
+    drop_empty_dbg_cu(*M);
+
+    // replay what CSE did the first time
+    std::string line;
+    while (std::getline(stats, line)) {
+        size_t comma = line.find(',');
+        for (unsigned i = 0; i < nCounters; i++) {
+            if (line.substr(0, comma) == Counters[i]->getName())
+                *Counters[i] += std::stoul(line.substr(comma + 1));
+        }
+    }
+    return true;
+}
+
+static void cache_store(Function &F, std::string key, const FunctionStats &FS) {
+    std::unique_ptr<Module> Extracted = extract_function(F);
+    if (!Extracted)
+        return;
+
+    // write to temporaries and rename so that concurrent runs never see
+    // a partial entry; the .stats file marks the entry complete
+    std::string tmp = "." + std::to_string(getpid()) + ".tmp";
+    std::error_code EC;
+    {
+        raw_fd_ostream bc(cache_path(key, ".bc") + tmp, EC, sys::fs::OF_None);
+        if (EC)
+            return;
+        WriteBitcodeToFile(*Extracted, bc);
+    }
+    {
+        std::ofstream stats(cache_path(key, ".stats") + tmp);
+        for (auto &e : FS.Eliminated)
+            stats << e.first.str() << "," << e.second << std::endl;
+    }
+    sys::fs::rename(cache_path(key, ".bc") + tmp, cache_path(key, ".bc"));
+    sys::fs::rename(cache_path(key, ".stats") + tmp, cache_path(key, ".stats"));
 }
 
 static void CommonSubexpressionElimination(Module *M) {
-    DeadInstRemoval(M);
-    local_CSE(M);
-    elim_red_loads(M);
-    elim_red_store(M);
+    // counters reported per function in the json stats
+    llvm::Statistic *Counters[] = {&SCCPConst, &SCCPBranch, &SCCPDeadBlocks, &SCCPDeadInst,
+                                   &CSEDead, &CSESimplify, &CSEElim,
+                                   &CSELdElim, &CSEStore2Load, &CSEStElim};
+    const unsigned nCounters = sizeof(Counters) / sizeof(Counters[0]);
+
+    if (!CacheDir.empty())
+        sys::fs::create_directories(CacheDir);
+
+    for (auto &F : *M) {
+        if (F.isDeclaration())
+            continue;
+
+        FunctionStats FS;
+        FS.Name = F.getName().str();
+        FS.InstsBefore = count_instructions(F);
+
+        std::vector<uint64_t> before;
+        for (auto *C : Counters)
+            before.push_back(C->getValue());
+
+        // run one phase on F and record how long it took
+        auto phase = [&](StringRef name, void (*run)(Function &)) {
+            auto start = std::chrono::steady_clock::now();
+            run(F);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            FS.Seconds.push_back({name, elapsed.count()});
+        };
+
+        std::string key;
+        if (!CacheDir.empty() && !F.getSubprogram())
+            key = cache_key(F);
+
+        bool hit = !key.empty() && cache_lookup(F, key, Counters, nCounters);
+        if (hit) {
+            CSECacheHit++;
+        } else {
+            if (!NoSCCP)
+                phase("SparseCondConstProp", SparseCondConstProp);
+            phase("DeadInstRemoval", DeadInstRemoval);
+            phase("local_CSE", local_CSE);
+            phase("elim_red_loads", elim_red_loads);
+            phase("elim_red_store", elim_red_store);
+        }
+
+        FS.InstsAfter = count_instructions(F);
+        for (unsigned i = 0; i < nCounters; i++)
+            FS.Eliminated.push_back({Counters[i]->getName(), Counters[i]->getValue() - before[i]});
+
+        if (!key.empty() && !hit) {
+            CSECacheMiss++;
+            cache_store(F, key, FS);
+        }
+        FuncStats.push_back(FS);
+    }
     // errs() << "CSEElim = " << CSEElim << " \n";
     // errs() << "CSEDead = " << CSEDead << " \n";
     // errs() << "CSELdElim = " << CSELdElim << " \n";
 }
+
+static llvm::Statistic MergedFunctions = {"", "MergedFunctions", "identical functions merged"};
+
+/*
+Functions are bucketed by FunctionComparator's hash and compared exactly
+within a bucket; the first function of a set of equals (in module order)
+is kept. A duplicate is then
+  - deleted, its uses pointing at the kept function, if it is local and
+    its address is unnamed_addr or only ever called,
+  - replaced by an alias, if only its name is visible (unnamed_addr)
+    and it is not in a comdat,
+  - turned into a thunk that tail calls the kept function otherwise,
+    so that its address stays distinct; its direct calls go to the kept
+    function.
+*/
+// every use of F is a call of it
+static bool only_called(Function *F) {
+    for (Use &U : F->uses()) {
+        CallBase *CB = dyn_cast<CallBase>(U.getUser());
+        if (!CB || !CB->isCallee(&U))
+            return false;
+    }
+    return true;
+}
+
+static bool merges_to_thunk(Function *F) {
+    if (F->hasLocalLinkage())
+        return !F->hasGlobalUnnamedAddr() && !only_called(F);
+    return !F->hasGlobalUnnamedAddr() || F->hasComdat();
+}
+
+static void merge_into(Function *F, Function *Keep) {
+    if (merges_to_thunk(F)) {
+        for (Use &U : make_early_inc_range(F->uses())) {
+            CallBase *CB = dyn_cast<CallBase>(U.getUser());
+            if (CB && CB->isCallee(&U))
+                U.set(Keep);
+        }
+
+        GlobalValue::LinkageTypes linkage = F->getLinkage();
+        F->deleteBody();
+        F->setLinkage(linkage);
+
+        BasicBlock *BB = BasicBlock::Create(F->getContext(), "entry", F);
+        IRBuilder<> Builder(BB);
+        std::vector<Value*> args;
+        for (auto &Arg : F->args())
+            args.push_back(&Arg);
+        CallInst *CI = Builder.CreateCall(Keep->getFunctionType(), Keep, args);
+        CI->setTailCall();
+        CI->setCallingConv(Keep->getCallingConv());
+        if (F->getReturnType()->isVoidTy())
+            Builder.CreateRetVoid();
+        else
+            Builder.CreateRet(CI);
+    } else if (F->hasLocalLinkage()) {
+        F->replaceAllUsesWith(Keep);
+        F->eraseFromParent();
+    } else {
+        GlobalAlias *GA = GlobalAlias::create(F->getValueType(), F->getAddressSpace(),
+                                              F->getLinkage(), "", Keep, F->getParent());
+        GA->setVisibility(F->getVisibility());
+        GA->setUnnamedAddr(F->getUnnamedAddr());
+        GA->takeName(F);
+        F->replaceAllUsesWith(GA);
+        F->eraseFromParent();
+    }
+    MergedFunctions++;
+}
+
+static void MergeIdenticalFunctions(Module *M) {
+    std::map<FunctionComparator::FunctionHash, std::vector<Function*>> buckets;
+    for (auto &F : *M) {
+        // the linker may pick another body for interposable functions
+        if (F.isDeclaration() || F.isInterposable() || F.hasAvailableExternallyLinkage())
+            continue;
+        buckets[FunctionComparator::functionHash(F)].push_back(&F);
+    }
+
+    GlobalNumberState GlobalNumbers;
+    for (auto &b : buckets) {
+        std::vector<Function*> kept;
+        for (Function *F : b.second) {
+            Function *Equal = nullptr;
+            for (Function *K : kept) {
+                if (FunctionComparator(F, K, &GlobalNumbers).compare() == 0) {
+                    Equal = K;
+                    break;
+                }
+            }
+            // a vararg thunk cannot forward its arguments
+            if (Equal && !(merges_to_thunk(F) && F->isVarArg()))
+                merge_into(F, Equal);
+            else
+                kept.push_back(F);
+        }
+    }
+}
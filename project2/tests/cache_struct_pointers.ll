@@ -0,0 +1,45 @@
+; Functions taking and loading pointers to a named (and recursive) struct.
+; Read back from the cache, their types come in as %struct.Node.0 and
+; have to be mapped back to the module's %struct.Node, pointers included.
+; main returns 3+3+4+4 = 14.
+
+%struct.Node = type { %struct.Node*, i32 }
+
+define internal i32 @total(%struct.Node* %n) {
+entry:
+  br label %loop
+
+loop:
+  %p = phi %struct.Node* [ %n, %entry ], [ %next, %body ]
+  %s = phi i32 [ 0, %entry ], [ %s2, %body ]
+  %end = icmp eq %struct.Node* %p, null
+  br i1 %end, label %done, label %body
+
+body:
+  %vp = getelementptr inbounds %struct.Node, %struct.Node* %p, i64 0, i32 1
+  %v = load i32, i32* %vp
+  %v2 = load i32, i32* %vp
+  %nextp = getelementptr inbounds %struct.Node, %struct.Node* %p, i64 0, i32 0
+  %next = load %struct.Node*, %struct.Node** %nextp
+  %t = add i32 %v, %v2
+  %s2 = add i32 %s, %t
+  br label %loop
+
+done:
+  ret i32 %s
+}
+
+define i32 @main() {
+  %a = alloca %struct.Node
+  %b = alloca %struct.Node
+  %an = getelementptr inbounds %struct.Node, %struct.Node* %a, i64 0, i32 0
+  %av = getelementptr inbounds %struct.Node, %struct.Node* %a, i64 0, i32 1
+  %bn = getelementptr inbounds %struct.Node, %struct.Node* %b, i64 0, i32 0
+  %bv = getelementptr inbounds %struct.Node, %struct.Node* %b, i64 0, i32 1
+  store %struct.Node* %b, %struct.Node** %an
+  store i32 3, i32* %av
+  store %struct.Node* null, %struct.Node** %bn
+  store i32 4, i32* %bv
+  %r = call i32 @total(%struct.Node* %a)
+  ret i32 %r
+}
@@ -0,0 +1,37 @@
+; @f and @g are identical, and their addresses go into @table. Merging
+; may not make the two entries equal: @g has to stay a thunk of @f. @h
+; is only ever called, so it can go away completely. main returns 42,
+; plus 100 if the two entries compare equal.
+
+@table = global [2 x i32 (i32)*] [i32 (i32)* @f, i32 (i32)* @g]
+
+define internal i32 @f(i32 %x) {
+  %y = mul i32 %x, 2
+  ret i32 %y
+}
+
+define internal i32 @g(i32 %x) {
+  %y = mul i32 %x, 2
+  ret i32 %y
+}
+
+define internal i32 @h(i32 %x) {
+  %y = mul i32 %x, 2
+  ret i32 %y
+}
+
+define i32 @main() {
+  %a = call i32 @f(i32 10)
+  %b = call i32 @g(i32 10)
+  %c = call i32 @h(i32 1)
+  %ab = add i32 %a, %b
+  %abc = add i32 %ab, %c
+  %p0 = getelementptr [2 x i32 (i32)*], [2 x i32 (i32)*]* @table, i64 0, i64 0
+  %p1 = getelementptr [2 x i32 (i32)*], [2 x i32 (i32)*]* @table, i64 0, i64 1
+  %f0 = load i32 (i32)*, i32 (i32)** %p0
+  %f1 = load i32 (i32)*, i32 (i32)** %p1
+  %same = icmp eq i32 (i32)* %f0, %f1
+  %penalty = select i1 %same, i32 100, i32 0
+  %r = add i32 %abc, %penalty
+  ret i32 %r
+}
@@ -0,0 +1,50 @@
+#!/usr/bin/env bash
+#
+# Regression test driver: optimizes <input> with p2 [flags], runs the
+# result with lli and expects it to exit with <code>. With -runs=<n> p2
+# runs n times with -cse-cache on a fresh directory, and in the last run
+# every function has to come from the cache.
+#
+# USAGE: run_test.sh <p2> <lli> <input> <code> [-runs=<n>] [p2 flags]...
+
+set -u
+
+P2=$1
+LLI=$2
+INPUT=$3
+CODE=$4
+shift 4
+
+RUNS=1
+if [ $# -gt 0 ] && [ "${1#-runs=}" != "$1" ]; then
+    RUNS=${1#-runs=}
+    shift
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+FLAGS=("$@")
+if [ "$RUNS" -gt 1 ]; then
+    FLAGS+=("-cse-cache=$WORK/cache")
+fi
+
+for run in $(seq "$RUNS"); do
+    if ! "$P2" "${FLAGS[@]}" "$INPUT" "$WORK/out.bc"; then
+        echo "run $run: p2 failed"
+        exit 1
+    fi
+    "$LLI" "$WORK/out.bc"
+    rc=$?
+    if [ "$rc" != "$CODE" ]; then
+        echo "run $run: exit code $rc, expected $CODE"
+        exit 1
+    fi
+done
+
+if [ "$RUNS" -gt 1 ] && grep -q "^CSECacheMiss," "$WORK/out.bc.stats"; then
+    echo "run $RUNS: functions were optimized again instead of taken from the cache"
+    grep "^CSECache" "$WORK/out.bc.stats"
+    exit 1
+fi
+exit 0
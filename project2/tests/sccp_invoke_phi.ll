@@ -0,0 +1,33 @@
+; %v comes from an invoke, which ends its block. SCCP has to treat it as
+; overdefined rather than unknown, or the phi in %join folds to 5 and f
+; returns 5 instead of the 7 that g returns.
+
+declare i32 @__gxx_personality_v0(...)
+
+define i32 @g() {
+  ret i32 7
+}
+
+define i32 @f(i1 %c) personality i32 (...)* @__gxx_personality_v0 {
+entry:
+  br i1 %c, label %a, label %b
+
+a:
+  %v = invoke i32 @g() to label %join unwind label %lpad
+
+b:
+  br label %join
+
+join:
+  %r = phi i32 [ %v, %a ], [ 5, %b ]
+  ret i32 %r
+
+lpad:
+  %lp = landingpad { i8*, i32 } cleanup
+  ret i32 -1
+}
+
+define i32 @main() {
+  %r = call i32 @f(i1 true)
+  ret i32 %r
+}
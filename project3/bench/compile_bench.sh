@@ -0,0 +1,109 @@
+#!/usr/bin/env bash
+#
+# Compile-time benchmark for p3.
+#
+# Every input (.bc or .ll) is protected by p3 once per -j value and the
+# best wall time of the runs is recorded, together with the SWFTadd
+# statistic. The output bitcode of every -j value is compared with the one
+# of -j 1, which must be identical.
+#
+# USAGE: compile_bench.sh [-o results.csv] [-r runs] [-j "1 2 4 ..."]
+#                         [-f "p3 flags"] <path to p3> <corpus dir or files>...
+#
+# By default -j is "1" and the number of cores, and -f is
+# "-swft-checks=sync -inline-checks".
+
+set -u
+
+RESULTS=compile_results.csv
+RUNS=3
+JOBS="1 $(nproc 2>/dev/null || echo 1)"
+FLAGS="-swft-checks=sync -inline-checks"
+
+# the header comment above
+usage() {
+    sed -n '3,/^$/s/^# \{0,1\}//p' "$0"
+    exit 1
+}
+
+while getopts "o:r:j:f:h" flag; do
+    case $flag in
+        o) RESULTS=$OPTARG ;;
+        r) RUNS=$OPTARG ;;
+        j) JOBS=$OPTARG ;;
+        f) FLAGS=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -lt 2 ]; then
+    usage
+fi
+
+P3=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+
+INPUTS=()
+for arg in "$@"; do
+    if [ -d "$arg" ]; then
+        for f in "$arg"/*.bc "$arg"/*.ll; do
+            [ -e "$f" ] && INPUTS+=("$f")
+        done
+    else
+        INPUTS+=("$arg")
+    fi
+done
+
+if [ ${#INPUTS[@]} -eq 0 ]; then
+    echo "compile_bench.sh: no .bc or .ll inputs found" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now() {
+    date +%s.%N
+}
+
+echo "input,jobs,compile_s,SWFTadd,output" > "$RESULTS"
+
+for input in "${INPUTS[@]}"; do
+    name=$(basename "$input")
+    name=${name%.*}
+
+    for j in $JOBS; do
+        out=$WORK/$name.j$j.bc
+        best=
+        for _ in $(seq "$RUNS"); do
+            start=$(now)
+            # shellcheck disable=SC2086
+            if ! "$P3" $FLAGS -j "$j" "$input" "$out" >/dev/null 2>"$WORK/err"; then
+                best=fail
+                break
+            fi
+            end=$(now)
+            t=$(echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }')
+            if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then
+                best=$t
+            fi
+        done
+        if [ "$best" = fail ]; then
+            echo "$name,$j,fail,," >> "$RESULTS"
+            continue
+        fi
+
+        added=$(grep "^SWFTadd," "$out.stats" 2>/dev/null | cut -d, -f2)
+        if [ ! -e "$WORK/$name.j1.bc" ]; then
+            output=n/a
+        elif cmp -s "$out" "$WORK/$name.j1.bc"; then
+            output=same
+        else
+            output=DIFFERS
+        fi
+        echo "$name,$j,$best,${added:-0},$output" >> "$RESULTS"
+    done
+done
+
+column -s, -t < "$RESULTS" 2>/dev/null || tr , '\t' < "$RESULTS"
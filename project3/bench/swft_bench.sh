@@ -0,0 +1,183 @@
+#!/usr/bin/env bash
+#
+# Overhead benchmark for p3's software fault tolerance.
+#
+# Every input (.bc or .ll) is protected by p3 in each variant below, then
+# built with llc and the local C compiler and run. We record p3's compile
+# time, the SWFTadd/Instructions/instCoverage statistics, the fault
+# coverage estimate (instCoverage / Instructions), the native run time and
+# its overhead relative to the unprotected build. Outputs are compared with
+# the unprotected build's.
+#
+# Variants (name=p3 flags):
+#   none=-no-swft
+#   every=-swft-checks=every
+#   sync=-swft-checks=sync
+#   every-inline=-swft-checks=every -inline-checks
+#   every-inline-elim=-swft-checks=every -inline-checks -elim-redundant-checks
+#   sync-inline=-swft-checks=sync -inline-checks
+#   sync-reopt=-swft-checks=sync -inline-checks -reopt
+#   block-inline=-swft-checks=block -inline-checks
+#   loop-inline=-swft-checks=loop -inline-checks
+#   sync-simd=-swft-checks=sync -inline-checks -simd-dup
+#   block-simd=-swft-checks=block -inline-checks -simd-dup
+#   tmr-sync=-tmr -swft-checks=sync -inline-checks
+#   srmt=-srmt
+# More can be added with -v, e.g. -v "mine=-swft-checks=sync -no".
+#
+# USAGE: swft_bench.sh [-o results.csv] [-r runs] [-v name=flags]...
+#                      <path to p3> <corpus dir or files>...
+#
+# Environment: LLC, CC override the tools used; RUN_ARGS is passed to
+# every program. Variants with -srmt are linked with SRMT_RUNTIME
+# (default: libsrmt_runtime.a next to p3) and -lpthread.
+
+set -u
+
+LLC=${LLC:-llc}
+CC=${CC:-cc}
+RUN_ARGS=${RUN_ARGS:-}
+
+RESULTS=swft_results.csv
+RUNS=3
+VARIANTS=(
+    "none=-no-swft"
+    "every=-swft-checks=every"
+    "sync=-swft-checks=sync"
+    "every-inline=-swft-checks=every -inline-checks"
+    "every-inline-elim=-swft-checks=every -inline-checks -elim-redundant-checks"
+    "sync-inline=-swft-checks=sync -inline-checks"
+    "sync-reopt=-swft-checks=sync -inline-checks -reopt"
+    "block-inline=-swft-checks=block -inline-checks"
+    "loop-inline=-swft-checks=loop -inline-checks"
+    "sync-simd=-swft-checks=sync -inline-checks -simd-dup"
+    "block-simd=-swft-checks=block -inline-checks -simd-dup"
+    "tmr-sync=-tmr -swft-checks=sync -inline-checks"
+    "srmt=-srmt"
+)
+
+# the header comment above
+usage() {
+    sed -n '3,/^$/s/^# \{0,1\}//p' "$0"
+    exit 1
+}
+
+while getopts "o:r:v:h" flag; do
+    case $flag in
+        o) RESULTS=$OPTARG ;;
+        r) RUNS=$OPTARG ;;
+        v) VARIANTS+=("$OPTARG") ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -lt 2 ]; then
+    usage
+fi
+
+P3=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+SRMT_RUNTIME=${SRMT_RUNTIME:-$(dirname "$P3")/libsrmt_runtime.a}
+
+INPUTS=()
+for arg in "$@"; do
+    if [ -d "$arg" ]; then
+        for f in "$arg"/*.bc "$arg"/*.ll; do
+            [ -e "$f" ] && INPUTS+=("$f")
+        done
+    else
+        INPUTS+=("$arg")
+    fi
+done
+
+if [ ${#INPUTS[@]} -eq 0 ]; then
+    echo "swft_bench.sh: no .bc or .ll inputs found" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now() {
+    date +%s.%N
+}
+
+# value of a stat from a p3 .stats file, 0 if absent
+stat_value() {
+    local v
+    v=$(grep "^$2," "$1" 2>/dev/null | cut -d, -f2)
+    echo "${v:-0}"
+}
+
+# best of $RUNS native runs, output left in $WORK/run.out
+run_native() {
+    local exe=$1 best=
+    for _ in $(seq "$RUNS"); do
+        local start end t
+        start=$(now)
+        # shellcheck disable=SC2086
+        "$exe" $RUN_ARGS </dev/null >"$WORK/run.out" 2>/dev/null
+        end=$(now)
+        t=$(echo "$start $end" | awk '{ printf "%.4f", $2 - $1 }')
+        if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then
+            best=$t
+        fi
+    done
+    echo "$best"
+}
+
+echo "input,variant,compile_s,SWFTadd,instructions,instCoverage,coverage,run_s,overhead,output" > "$RESULTS"
+
+for input in "${INPUTS[@]}"; do
+    name=$(basename "$input")
+    name=${name%.*}
+    base_run=
+
+    for v in "${VARIANTS[@]}"; do
+        variant=${v%%=*}
+        flags=${v#*=}
+        out=$WORK/$name.$variant.bc
+
+        start=$(now)
+        # shellcheck disable=SC2086
+        if ! "$P3" $flags "$input" "$out" >/dev/null 2>"$WORK/err"; then
+            echo "$name,$variant,fail,,,,,,," >> "$RESULTS"
+            continue
+        fi
+        end=$(now)
+        compile=$(echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }')
+
+        added=$(stat_value "$out.stats" SWFTadd)
+        insts=$(stat_value "$out.stats" Instructions)
+        covered=$(stat_value "$out.stats" instCoverage)
+        coverage=$(echo "$covered $insts" | awk '{ printf "%.1f%%", $2 ? 100 * $1 / $2 : 0 }')
+
+        libs=(-lm)
+        case " $flags " in
+            *" -srmt "*) libs=("$SRMT_RUNTIME" -lpthread -lm) ;;
+        esac
+
+        runtime=n/a
+        overhead=n/a
+        output=n/a
+        if "$LLC" -O2 -relocation-model=pic "$out" -o "$WORK/$name.s" 2>/dev/null &&
+           "$CC" "$WORK/$name.s" -o "$WORK/$name.exe" "${libs[@]}" 2>/dev/null; then
+            runtime=$(run_native "$WORK/$name.exe")
+            if [ -z "$base_run" ]; then
+                base_run=$runtime
+                cp "$WORK/run.out" "$WORK/$name.expected"
+                output=ref
+            elif cmp -s "$WORK/run.out" "$WORK/$name.expected"; then
+                output=ok
+            else
+                output=DIFF
+            fi
+            overhead=$(echo "$runtime $base_run" | awk '{ printf "%.2fx", ($2 > 0) ? $1 / $2 : 0 }')
+        fi
+
+        echo "$name,$variant,$compile,$added,$insts,$covered,$coverage,$runtime,$overhead,$output" >> "$RESULTS"
+    done
+done
+
+column -s, -t < "$RESULTS" 2>/dev/null || tr , '\t' < "$RESULTS"
@@ -0,0 +1,530 @@
+/*  campaign: fault-injection campaign driver for fi.
+
+    Builds and runs the uninjected program once for the golden output, then
+    makes -n injected variants with fi (seeds -seed, -seed+1, ...), compiles
+    them with llc and cc and runs each with a timeout, -j at a time. Every
+    run is classified against the golden run:
+
+      detected  exited with assert_ft's code (1099, seen as 1099 & 0xff)
+      hang      killed after the timeout
+      crash     killed by a signal, or an exit code other than the golden one
+      sdc       same exit code, different output (silent data corruption)
+      benign    same exit code and output
+
+    Runs where fi, llc or cc fail, or fi could not place its faults, are
+    counted as errors and left out of the rates. Rates are printed with
+    95% Wilson score intervals.
+
+    With -runtime-select, fi instruments every fault site of the input once
+    (fi -runtime-select) and the single resulting binary serves all runs:
+    run i faults a site drawn uniformly with seed+i, passed to the program
+    in FI_FAULT_ID. The golden run is the same binary without a fault.
+
+    -exhaustive replaces the -n random runs with one run per fault site,
+    in the order of fi -list-sites (fi -inject-site=<i> per variant, or
+    FI_FAULT_ID=<i> with -runtime-select).
+
+    -fork-server=<fn> additionally links runtime/fi_forkserver.c and marks
+    the start of <fn>: the program is started once, and every run is a
+    child forked at the marker, -j at a time. Only the output written
+    after the marker is compared, and faults in code that only runs before
+    the marker never fire, so they count as benign.
+
+    USAGE: campaign [options] <input bitcode> [-run-arg=<arg>]...
+*/
+
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+extern char **environ;
+
+static cl::opt<std::string>
+        InputFilename(cl::Positional, cl::desc("<input bitcode>"), cl::Required);
+
+static cl::opt<unsigned>
+        NumRuns("n",
+              cl::desc("Number of injected runs."),
+              cl::init(1000));
+
+static cl::opt<unsigned>
+        Jobs("j",
+              cl::desc("Runs built and executed at the same time (0 = all cores)."),
+              cl::init(0));
+
+static cl::opt<double>
+        Timeout("timeout",
+              cl::desc("Seconds before a run counts as a hang (default: 10x the golden run, at least 1)."),
+              cl::init(0));
+
+static cl::opt<unsigned>
+        Seed("seed",
+              cl::desc("fi seed of the first run; run i uses seed+i."),
+              cl::init(1));
+
+static cl::opt<std::string>
+        FiPath("fi",
+              cl::desc("fi executable (default: the one next to campaign)."),
+              cl::init(""));
+
+static cl::list<std::string>
+        FiArgs("fi-arg",
+              cl::desc("Extra argument for fi, e.g. -fi-arg=-no-flow-errors."));
+
+static cl::list<std::string>
+        RunArgs("run-arg",
+              cl::desc("Argument passed to every run of the program."));
+
+static cl::opt<std::string>
+        OutputFilename("o",
+              cl::desc("Write one CSV line per run to this file."),
+              cl::value_desc("filename"),
+              cl::init(""));
+
+static cl::opt<bool>
+        RuntimeSelect("runtime-select",
+              cl::desc("Build one binary with every fault site and pick the site per run at run time."),
+              cl::init(false));
+
+static cl::opt<bool>
+        Exhaustive("exhaustive",
+              cl::desc("Run every fault site once instead of -n random ones."),
+              cl::init(false));
+
+static cl::opt<std::string>
+        ForkServer("fork-server",
+              cl::desc("Fork the runs at the start of this function (implies -runtime-select)."),
+              cl::value_desc("function"),
+              cl::init(""));
+
+static cl::opt<std::string>
+        FiRuntime("fi-runtime",
+              cl::desc("fi_runtime library for -fork-server (default: the one next to campaign)."),
+              cl::init(""));
+
+static cl::opt<bool>
+        Keep("keep",
+              cl::desc("Keep the work directory with every variant."),
+              cl::init(false));
+
+// exit code of assert_ft as seen by the parent
+static const int DetectedExit = 1099 & 0xff;
+
+enum Outcome { Detected, SDC, Crash, Hang, Benign, RunError, NumOutcomes };
+
+static const char *OutcomeNames[NumOutcomes] = {"detected", "sdc", "crash", "hang", "benign", "error"};
+
+struct ExecResult {
+  bool started = false;
+  bool timedOut = false;
+  int exitCode = 0;
+  int signal = 0;
+  double seconds = 0;
+};
+
+struct RunRecord {
+  unsigned seed = 0;
+  unsigned site = 0;
+  Outcome outcome = RunError;
+  ExecResult exec;
+};
+
+/*  Runs argv[0] (searched in PATH) with stdin from /dev/null, stdout to
+    stdoutPath and stderr dropped. timeout <= 0 waits forever, otherwise the
+    child is killed with SIGKILL once it has run for that many seconds.
+    posix_spawn and waitpid keep this safe to call from the worker threads.
+*/
+static ExecResult Execute(const std::vector<std::string> &argv, const std::string &stdoutPath,
+                          double timeout, const std::vector<std::string> &extraEnv = {}) {
+  ExecResult result;
+
+  std::vector<char*> args;
+  for (const std::string &a : argv)
+    args.push_back(const_cast<char*>(a.c_str()));
+  args.push_back(nullptr);
+
+  // extraEnv overrides variables of the same name
+  std::vector<char*> envp;
+  for (char **e = environ; *e; e++) {
+    StringRef name = StringRef(*e).split('=').first;
+    if (std::none_of(extraEnv.begin(), extraEnv.end(),
+                     [&](const std::string &x) { return StringRef(x).split('=').first == name; }))
+      envp.push_back(*e);
+  }
+  for (const std::string &e : extraEnv)
+    envp.push_back(const_cast<char*>(e.c_str()));
+  envp.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, 1, stdoutPath.empty() ? "/dev/null" : stdoutPath.c_str(),
+                                   O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid;
+  int err = posix_spawnp(&pid, args[0], &actions, nullptr, args.data(), envp.data());
+  posix_spawn_file_actions_destroy(&actions);
+  if (err != 0)
+    return result;
+  result.started = true;
+
+  int status = 0;
+  auto delay = std::chrono::microseconds(100);
+  while (true) {
+    pid_t r = waitpid(pid, &status, timeout > 0 ? WNOHANG : 0);
+    if (r == pid)
+      break;
+    if (r < 0) {
+      result.started = false;
+      return result;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (elapsed.count() > timeout) {
+      kill(pid, SIGKILL);
+      waitpid(pid, &status, 0);
+      result.timedOut = true;
+      break;
+    }
+    std::this_thread::sleep_for(delay);
+    delay = std::min(delay * 2, std::chrono::microseconds(10000));
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  result.seconds = elapsed.count();
+  if (WIFEXITED(status))
+    result.exitCode = WEXITSTATUS(status);
+  else if (WIFSIGNALED(status))
+    result.signal = WTERMSIG(status);
+  return result;
+}
+
+static bool Succeeded(const ExecResult &r) {
+  return r.started && !r.timedOut && r.signal == 0 && r.exitCode == 0;
+}
+
+static std::string ReadFile(const std::string &path) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(path);
+  return buf ? (*buf)->getBuffer().str() : std::string();
+}
+
+static std::string LLC, CC, FI, Runtime;
+
+// llc + cc, the same way swft_bench.sh builds its programs
+static bool Build(const std::string &bc, const std::string &exe) {
+  std::string asmFile = exe + ".s";
+  std::vector<std::string> ccArgv = {CC, asmFile, "-o", exe};
+  if (!ForkServer.empty())
+    ccArgv.push_back(Runtime);
+  ccArgv.push_back("-lm");
+  bool ok = Succeeded(Execute({LLC, "-O2", "-relocation-model=pic", bc, "-o", asmFile}, "", 0)) &&
+            Succeeded(Execute(ccArgv, "", 0));
+  sys::fs::remove(asmFile);
+  return ok;
+}
+
+static std::vector<std::string> ProgramArgv(const std::string &exe) {
+  std::vector<std::string> argv = {exe};
+  argv.insert(argv.end(), RunArgs.begin(), RunArgs.end());
+  return argv;
+}
+
+// the fault site of a -runtime-select run
+static unsigned ChooseSite(unsigned run, unsigned seed, unsigned numSites) {
+  if (Exhaustive)
+    return run + 1;
+  std::mt19937 rng(seed);
+  return std::uniform_int_distribution<unsigned>(1, numSites)(rng);
+}
+
+/*  Starts exe once as a fork server (runtime/fi_forkserver.c) that forks a
+    child per entry of ids. Child n writes its output to outDir/<n>.out;
+    its exit status lands in results[n].
+*/
+static bool RunForkServer(const std::string &exe, const std::string &outDir, const std::vector<unsigned> &ids,
+                          double timeout, std::vector<ExecResult> &results) {
+  if (sys::fs::create_directories(outDir))
+    return false;
+  {
+    std::error_code EC;
+    raw_fd_ostream idFile(outDir + "/ids", EC, sys::fs::OF_Text);
+    if (EC)
+      return false;
+    for (unsigned id : ids)
+      idFile << id << "\n";
+  }
+
+  unsigned jobs = hardware_concurrency(Jobs).compute_thread_count();
+  ExecResult server = Execute(ProgramArgv(exe), "", 0,
+                              {"FI_FORK_SERVER=1", "FI_FORK_IDS=" + outDir + "/ids", "FI_FORK_OUT=" + outDir,
+                               "FI_FORK_RESULTS=" + outDir + "/results", "FI_FORK_JOBS=" + std::to_string(jobs),
+                               "FI_FORK_TIMEOUT=" + std::to_string(timeout)});
+  if (!Succeeded(server))
+    return false;
+
+  results.assign(ids.size(), ExecResult());
+  std::string text = ReadFile(outDir + "/results");
+  unsigned found = 0;
+  for (StringRef line : split(StringRef(text), '\n')) {
+    unsigned n, id, timedOut;
+    ExecResult r;
+    if (sscanf(line.str().c_str(), "%u %u %d %d %u %lf", &n, &id, &r.exitCode, &r.signal, &timedOut,
+               &r.seconds) != 6 || n >= ids.size())
+      continue;
+    r.started = true;
+    r.timedOut = timedOut;
+    results[n] = r;
+    found++;
+  }
+  return found == ids.size();
+}
+
+static Outcome Classify(const ExecResult &r, const std::string &output, int goldenExit,
+                        const std::string &goldenOutput) {
+  if (!r.started)
+    return RunError;
+  if (r.timedOut)
+    return Hang;
+  if (r.signal != 0)
+    return Crash;
+  if (r.exitCode == DetectedExit && goldenExit != DetectedExit)
+    return Detected;
+  if (r.exitCode != goldenExit)
+    return Crash;
+  return output == goldenOutput ? Benign : SDC;
+}
+
+/*  95% Wilson score interval of k successes in n trials, as [lo, hi]. */
+static std::pair<double, double> Wilson(unsigned k, unsigned n) {
+  if (n == 0)
+    return {0, 1};
+  const double z = 1.96;
+  double p = (double)k / n;
+  double denom = 1 + z * z / n;
+  double center = (p + z * z / (2 * n)) / denom;
+  double half = z * std::sqrt(p * (1 - p) / n + z * z / (4.0 * n * n)) / denom;
+  return {std::max(0.0, center - half), std::min(1.0, center + half)};
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "fault-injection campaign\n");
+  llvm_shutdown_obj Y;
+
+  const char *env = getenv("LLC");
+  LLC = env ? env : "llc";
+  env = getenv("CC");
+  CC = env ? env : "cc";
+  FI = FiPath;
+  if (FI.empty()) {
+    SmallString<256> self(sys::fs::getMainExecutable(argv[0], (void*)&main));
+    sys::path::remove_filename(self);
+    sys::path::append(self, "fi");
+    FI = std::string(self);
+  }
+  Runtime = FiRuntime;
+  if (Runtime.empty()) {
+    SmallString<256> self(sys::fs::getMainExecutable(argv[0], (void*)&main));
+    sys::path::remove_filename(self);
+    sys::path::append(self, "libfi_runtime.a");
+    Runtime = std::string(self);
+  }
+  if (!ForkServer.empty())
+    RuntimeSelect = true;
+
+  SmallString<256> work;
+  if (std::error_code EC = sys::fs::createUniqueDirectory("fi-campaign", work)) {
+    errs() << "campaign: cannot create a work directory: " << EC.message() << "\n";
+    return 1;
+  }
+  std::string dir(work);
+
+  // golden run; with -runtime-select, the instrumented binary without a fault
+  std::string goldenExe = dir + "/golden";
+  unsigned numSites = 0;
+  if (RuntimeSelect) {
+    std::vector<std::string> fiArgv = {FI, "-runtime-select"};
+    if (!ForkServer.empty())
+      fiArgv.push_back("-fork-server=" + ForkServer);
+    fiArgv.insert(fiArgv.end(), FiArgs.begin(), FiArgs.end());
+    fiArgv.insert(fiArgv.end(), {InputFilename, "-o", dir + "/select.bc"});
+    if (!Succeeded(Execute(fiArgv, dir + "/select.fi.out", 0)) ||
+        sscanf(ReadFile(dir + "/select.fi.out").c_str(), "%u fault sites", &numSites) != 1 ||
+        numSites == 0) {
+      errs() << "campaign: " << FI << " -runtime-select found no fault sites in " << InputFilename << "\n";
+      return 1;
+    }
+  } else if (Exhaustive) {
+    std::vector<std::string> fiArgv = {FI, "-list-sites"};
+    fiArgv.insert(fiArgv.end(), FiArgs.begin(), FiArgs.end());
+    fiArgv.push_back(InputFilename);
+    if (!Succeeded(Execute(fiArgv, dir + "/sites", 0)) ||
+        sscanf(ReadFile(dir + "/sites").c_str(), "%u fault sites", &numSites) != 1 || numSites == 0) {
+      errs() << "campaign: " << FI << " -list-sites found no fault sites in " << InputFilename << "\n";
+      return 1;
+    }
+  }
+  if (Exhaustive)
+    NumRuns = numSites;
+  if (!Build(RuntimeSelect ? dir + "/select.bc" : std::string(InputFilename), goldenExe)) {
+    errs() << "campaign: cannot build " << InputFilename << " with " << LLC << " and " << CC << "\n";
+    return 1;
+  }
+  ExecResult golden;
+  std::string goldenOutput;
+  if (!ForkServer.empty()) {
+    std::vector<ExecResult> results;
+    if (!RunForkServer(goldenExe, dir + "/golden.fork", {0}, 0, results)) {
+      errs() << "campaign: the fork server did not start; is " << ForkServer << " reached?\n";
+      return 1;
+    }
+    golden = results[0];
+    goldenOutput = ReadFile(dir + "/golden.fork/0.out");
+  } else {
+    golden = Execute(ProgramArgv(goldenExe), dir + "/golden.out", 0);
+    goldenOutput = ReadFile(dir + "/golden.out");
+  }
+  if (!golden.started || golden.signal != 0) {
+    errs() << "campaign: the uninjected program did not run to completion\n";
+    return 1;
+  }
+  double timeout = Timeout > 0 ? Timeout : std::max(1.0, 10 * golden.seconds);
+
+  std::vector<RunRecord> runs(NumRuns);
+  std::atomic<unsigned> done(0);
+  std::mutex progressLock;
+  auto start = std::chrono::steady_clock::now();
+
+  auto runOne = [&](unsigned i) {
+    RunRecord &rec = runs[i];
+    rec.seed = Seed + i;
+    std::string base = dir + "/run" + std::to_string(i);
+
+    if (RuntimeSelect) {
+      rec.site = ChooseSite(i, rec.seed, numSites);
+      rec.exec = Execute(ProgramArgv(goldenExe), base + ".out", timeout,
+                         {"FI_FAULT_ID=" + std::to_string(rec.site)});
+      rec.outcome = Classify(rec.exec, ReadFile(base + ".out"), golden.exitCode, goldenOutput);
+    } else {
+      rec.site = Exhaustive ? i + 1 : 0;
+      std::vector<std::string> fiArgv = {FI, Exhaustive ? "-inject-site=" + std::to_string(rec.site)
+                                                        : "-seed=" + std::to_string(rec.seed)};
+      fiArgv.insert(fiArgv.end(), FiArgs.begin(), FiArgs.end());
+      fiArgv.insert(fiArgv.end(), {InputFilename, "-o", base + ".bc"});
+
+      // fi reports a failed placement on stdout but still exits 0
+      if (Succeeded(Execute(fiArgv, base + ".fi.out", 0)) &&
+          ReadFile(base + ".fi.out").find("Failed to insert") == std::string::npos &&
+          Build(base + ".bc", base + ".exe")) {
+        rec.exec = Execute(ProgramArgv(base + ".exe"), base + ".out", timeout);
+        rec.outcome = Classify(rec.exec, ReadFile(base + ".out"), golden.exitCode, goldenOutput);
+      }
+    }
+
+    if (!Keep)
+      for (const char *ext : {".bc", ".fi.out", ".exe", ".out"})
+        sys::fs::remove(base + ext);
+
+    unsigned n = ++done;
+    if (n % std::max(1u, NumRuns / 20) == 0 || n == NumRuns) {
+      std::lock_guard<std::mutex> lock(progressLock);
+      errs() << "campaign: " << n << "/" << NumRuns << " runs\n";
+    }
+  };
+
+  if (!ForkServer.empty()) {
+    std::vector<unsigned> ids;
+    for (unsigned i = 0; i < NumRuns; i++) {
+      runs[i].seed = Seed + i;
+      runs[i].site = ChooseSite(i, runs[i].seed, numSites);
+      ids.push_back(runs[i].site);
+    }
+    std::vector<ExecResult> results;
+    if (!RunForkServer(goldenExe, dir + "/fork", ids, timeout, results)) {
+      errs() << "campaign: the fork server failed\n";
+      return 1;
+    }
+    for (unsigned i = 0; i < NumRuns; i++) {
+      runs[i].exec = results[i];
+      runs[i].outcome = Classify(results[i], ReadFile(dir + "/fork/" + std::to_string(i) + ".out"),
+                                 golden.exitCode, goldenOutput);
+    }
+  } else {
+    ThreadPool Pool(hardware_concurrency(Jobs));
+    for (unsigned i = 0; i < NumRuns; i++)
+      Pool.async([&runOne, i] { runOne(i); });
+    Pool.wait();
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  unsigned counts[NumOutcomes] = {0};
+  for (const RunRecord &rec : runs)
+    counts[rec.outcome]++;
+  unsigned valid = NumRuns - counts[RunError];
+
+  if (!OutputFilename.empty()) {
+    std::error_code EC;
+    raw_fd_ostream csv(OutputFilename, EC, sys::fs::OF_Text);
+    if (EC) {
+      errs() << "campaign: cannot write " << OutputFilename << ": " << EC.message() << "\n";
+    } else {
+      csv << "run,seed,site,outcome,exit,signal,run_s\n";
+      for (unsigned i = 0; i < NumRuns; i++)
+        csv << i << "," << runs[i].seed << "," << runs[i].site << "," << OutcomeNames[runs[i].outcome] << ","
+            << runs[i].exec.exitCode << "," << runs[i].exec.signal << ","
+            << format("%.4f", runs[i].exec.seconds) << "\n";
+    }
+  }
+
+  outs() << "golden run: exit " << golden.exitCode << ", " << format("%.3f", golden.seconds)
+         << "s; timeout " << format("%.3f", timeout) << "s\n";
+  outs() << NumRuns << " runs in " << format("%.1f", elapsed.count()) << "s ("
+         << format("%.1f", NumRuns / std::max(elapsed.count(), 1e-9)) << " runs/s)\n\n";
+  outs() << "outcome        runs     rate   95% CI\n";
+  for (int o = 0; o < RunError; o++) {
+    std::pair<double, double> ci = Wilson(counts[o], valid);
+    outs() << format("%-10s %8u %7.2f%%   [%.2f%%, %.2f%%]\n", OutcomeNames[o], counts[o],
+                     valid ? 100.0 * counts[o] / valid : 0.0, 100 * ci.first, 100 * ci.second);
+  }
+  outs() << format("%-10s %8u\n", OutcomeNames[RunError], counts[RunError]);
+
+  // everything but silent corruption is covered
+  std::pair<double, double> ci = Wilson(valid - counts[SDC], valid);
+  outs() << format("\ncoverage   %7.2f%%   [%.2f%%, %.2f%%]\n",
+                   valid ? 100.0 * (valid - counts[SDC]) / valid : 0.0, 100 * ci.first, 100 * ci.second);
+
+  if (!Keep)
+    sys::fs::remove_directories(dir);
+  else
+    errs() << "campaign: variants kept in " << dir << "\n";
+
+  return 0;
+}
@@ -0,0 +1,107 @@
+/*  checkprof: ranks the checks of a program protected with
+    p3 -check-profile=<file> by how often they ran.
+
+    Every run of the program appends one line per check that ran to <file>,
+      <function> <block> <uid> <data|cfg> <count>
+    checkprof adds up the counts of each check over all runs in the given
+    files and lists the checks, most executed first, with their share of
+    all check executions and the running total, so the few checks that
+    make up most of the overhead are at the top. With -by=block or
+    -by=function the checks of a block or a function are added up into
+    one row instead.
+
+    USAGE: checkprof [-by=site|block|function] [-top=<n>] <profile>...
+*/
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+enum Grouping { BySite, ByBlock, ByFunction };
+
+static cl::list<std::string>
+        InputFilenames(cl::Positional, cl::desc("<profile>..."), cl::OneOrMore);
+
+static cl::opt<Grouping>
+        By("by",
+              cl::desc("What a row adds up."),
+              cl::values(clEnumValN(BySite, "site", "one check"),
+                         clEnumValN(ByBlock, "block", "the checks made for a block"),
+                         clEnumValN(ByFunction, "function", "the checks of a function")),
+              cl::init(BySite));
+
+static cl::opt<unsigned>
+        Top("top",
+              cl::desc("Rows to print (0 = all)."),
+              cl::init(0));
+
+// what the profile lines of a row add up to, and the checks they came from
+struct Row {
+  uint64_t count = 0;
+  std::set<std::string> checks;
+};
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "check profile ranking\n");
+  llvm_shutdown_obj Y;
+
+  std::map<std::string, Row> rows;
+  uint64_t total = 0;
+  for (const std::string &path : InputFilenames) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(path);
+    if (!buf) {
+      errs() << "checkprof: cannot read " << path << ": " << buf.getError().message() << "\n";
+      return 1;
+    }
+    SmallVector<StringRef, 0> lines;
+    (*buf)->getBuffer().split(lines, '\n', -1, false);
+    for (unsigned n = 0; n < lines.size(); n++) {
+      SmallVector<StringRef, 5> fields;
+      lines[n].split(fields, ' ', -1, false);
+      uint64_t count;
+      if (fields.size() != 5 || fields[4].getAsInteger(10, count)) {
+        errs() << path << ":" << n + 1 << ": not <function> <block> <uid> <data|cfg> <count>\n";
+        return 1;
+      }
+      std::string site = (fields[0] + " " + fields[1] + " " + fields[2] + " " + fields[3]).str();
+      std::string key = By == BySite ? site : By == ByBlock ? (fields[0] + " " + fields[1]).str() : fields[0].str();
+      Row &row = rows[key];
+      row.count += count;
+      row.checks.insert(site);
+      total += count;
+    }
+  }
+
+  std::vector<std::pair<std::string, Row>> ranked(rows.begin(), rows.end());
+  std::stable_sort(ranked.begin(), ranked.end(),
+                   [](const auto &a, const auto &b) { return a.second.count > b.second.count; });
+  if (Top > 0 && ranked.size() > Top)
+    ranked.resize(Top);
+
+  static const char *Columns[] = {"function block uid kind", "function block", "function"};
+  outs() << rows.size() << " rows, " << total << " check executions\n\n";
+  outs() << " rank       executions   share   total  " << Columns[By] << "\n";
+  uint64_t sum = 0;
+  for (unsigned i = 0; i < ranked.size(); i++) {
+    sum += ranked[i].second.count;
+    outs() << format("%5u %16llu %6.2f%% %6.2f%%  ", i + 1, (unsigned long long)ranked[i].second.count,
+                     total ? 100.0 * ranked[i].second.count / total : 0.0, total ? 100.0 * sum / total : 0.0)
+           << ranked[i].first;
+    if (By != BySite)
+      outs() << " (" << ranked[i].second.checks.size() << " checks)";
+    outs() << "\n";
+  }
+  return 0;
+}
@@ -45,6 +45,8 @@
 #include <vector>
 #include <utility>
 #include <time.h>
+#include <random>
+#include <iterator>
 
 #include "llvm-c/Core.h"
 
@@ -66,6 +68,9 @@
 #include "llvm/Analysis/InstructionSimplify.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/InstVisitor.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Analysis/LoopAnalysisManager.h"
@@ -99,6 +104,34 @@ NumErrors("inject-count",
   cl::desc("Inject num errors."),
   cl::init(1));
 
+static cl::opt<unsigned>
+Seed("seed",
+  cl::desc("Seed for the fault site choice (0 = the current time)."),
+  cl::init(0));
+
+static cl::list<unsigned>
+InjectSites("inject-site",
+  cl::desc("Inject exactly these sites, numbered as by -list-sites, instead of -inject-count random ones."),
+  cl::CommaSeparated);
+
+static cl::opt<bool>
+ListSites("list-sites",
+  cl::desc("Print every fault site with its number and exit."),
+  cl::init(false));
+
+static cl::opt<bool>
+RuntimeSelect("runtime-select",
+  cl::desc("Instrument every fault site instead of injecting -inject-count faults; the "
+           "site to fault is chosen at run time by the FI_FAULT_ID environment variable."),
+  cl::init(false));
+
+static cl::opt<std::string>
+ForkServer("fork-server",
+  cl::desc("With -runtime-select, call fi_fork_server() (runtime/fi_forkserver.c) at the "
+           "start of this function, so runs can be forked from there."),
+  cl::value_desc("function"),
+  cl::init(""));
+
 static inline std::string
 GetFileNameRoot(const std::string &InputFilename) {
   std::string IFN = InputFilename;
@@ -118,6 +151,20 @@ GetFileNameRoot(const std::string &InputFilename) {
 void  BuildFlip(Module *M);
 Value *FlipRandomBit(Instruction *I);
 Value *FlipControlBit(Instruction *I);  
+
+/*  A place where fi can inject a fault: the condition of a conditional
+    branch (control), or the first operand of an instruction that is a
+    non-phi i32 instruction (data).
+*/
+struct FaultSite {
+  Instruction *I;
+  unsigned operand;
+  bool control;
+};
+
+static void CollectSites(Module *M, std::vector<FaultSite> &sites);
+static unsigned InstrumentSites(Module *M, std::vector<FaultSite> &sites);
+static bool InsertForkServer(Module *M, StringRef name);
   
 int
 main (int argc, char ** argv)
@@ -130,8 +177,6 @@ main (int argc, char ** argv)
     return 1;
   }
 
-  srand(time(NULL));
-
   
   // Handle creating output files and shutting down properly
   llvm_shutdown_obj Y;  // Call llvm_shutdown() on exit.
@@ -169,108 +214,104 @@ main (int argc, char ** argv)
       }
   }
 
-  Module::iterator fit, fend;
-  Function::iterator bit, bend;
-  BasicBlock::iterator it, iend;
-
   int ctrlInjCnt=0;
   int dataInjCnt=0;
 
   Module *m = M.get();
 
-  int attempts = 0;
+  if (!ForkServer.empty() && !RuntimeSelect)
+    {
+      fprintf(stderr,"-fork-server needs -runtime-select.\n");
+      return 1;
+    }
+
+  // the listing numbers the sites of the input, FI_FAULT_ID those of the
+  // instrumented program would be something else
+  if (ListSites && RuntimeSelect)
+    {
+      fprintf(stderr,"-list-sites cannot be combined with -runtime-select.\n");
+      return 1;
+    }
 
-  // Loop until we have injected enough errors.  
-  // Based on simple probability, we should eventually escape,
-  // but, may need to revisit for a few possible pathological cases
-  // that will trigger an infinite loop
-  while (ctrlInjCnt+dataInjCnt < NumErrors)     
+  if (RuntimeSelect)
     {
-      attempts++;
+      std::vector<FaultSite> sites;
+      CollectSites(m, sites);
+      unsigned ctrl = InstrumentSites(m, sites);
+      printf("%u fault sites (%u data, %u control), FI_FAULT_ID=1..%u\n",
+	     (unsigned)sites.size(), (unsigned)sites.size() - ctrl, ctrl, (unsigned)sites.size());
 
-      if (attempts > 100*NumErrors) {
-	printf("Failed to insert requested number of errors.\n");
-	break;
-      }
-      
-      bool injected = false;
-      for(fit=m->begin(), fend=m->end(); fit!=fend && !injected; fit++)
+      if (!ForkServer.empty() && !InsertForkServer(m, ForkServer))
+	{
+	  fprintf(stderr,"No function %s for -fork-server.\n",ForkServer.c_str());
+	  return 1;
+	}
+    }
+
+  if (ListSites)
+    {
+      std::vector<FaultSite> sites;
+      CollectSites(m, sites);
+      unsigned ctrl = std::count_if(sites.begin(), sites.end(), [](const FaultSite &s) { return s.control; });
+      printf("%u fault sites (%u data, %u control)\n", (unsigned)sites.size(), (unsigned)sites.size() - ctrl, ctrl);
+      for (unsigned i=0; i<sites.size(); i++)
 	{
-	  Function *F = &*fit;
+	  std::string inst;
+	  raw_string_ostream os(inst);
+	  sites[i].I->print(os);
+	  printf("%u %s %s:%s\n", i+1, sites[i].control ? "control" : "data",
+		 sites[i].I->getFunction()->getName().str().c_str(), os.str().c_str());
+	}
+      return 0;
+    }
+
+  // -inject-site, or NumErrors distinct sites drawn uniformly
+  if (!RuntimeSelect)
+    {
+      std::vector<FaultSite> sites, chosen;
+      CollectSites(m, sites);
 
-	  if (F->getName() == "assert_ft" || F->getName() == "assert_cfg_ft" || F->getName()=="flip") continue;
-	  
-	  if(!F->empty())
+      if (!InjectSites.empty())
+	{
+	  for (unsigned id : InjectSites)
 	    {
-	      for(bit=F->begin(),bend=F->end(); bit!=bend && !injected; bit++)
+	      if (id == 0 || id > sites.size())
 		{
-		  BasicBlock *BB = &*bit;
-		  
-		  for (it=BB->begin(),iend=BB->end(); it!=iend && !injected; it++)
-		    {
-		      Instruction *I = &*it;
-		      int r = rand() % 1023;
-
-		      // pick an instruction with a certain probability. This
-		      // helps guarantee we don't pick the same instruction every time
-		      if (r < 20) {
-			
-			// If we are allowed to inject control flow errors
-			if (!NoFlowInject)
-			  {
-			    if( isa<BranchInst>(I) )
-			      {
-				BranchInst *BI = (BranchInst*)I;
-				
-				if (BI->isConditional())
-				  {
-				    Value *V = BI->getCondition();
-				    // Invert the condition
-				    BinaryOperator *BO = 
-				      BinaryOperator::Create(Instruction::Xor,V,ConstantInt::get(V->getType(),1),"fi_inv",I);
-				    BI->setCondition(BO);
-				    ctrlInjCnt++;
-				    injected = true;
-				    break;
-				  }			    
-			      }
-			  }
-
-			// If we are allowed to inject data errors
-			if (!NoDataInject && !isa<BranchInst>(I) )
-			  {
-			    // Find an integer operand
-			    unsigned i;
-			    for(i=0; i<I->getNumOperands(); i++)
-			      {
-				Value *v = I->getOperand(i);
-				if (v->getType()->isIntegerTy() && isa<Instruction>(v) && !isa<PHINode>(v) && v->getType()==IntegerType::get(Context,32))
-				  {
-				    // inject a 0 or 1 based on random number
-				    // note: we may not actually change the behavior
-				    // if we replace with the same value.
-				    // Since it's probabilistic anyway, no reason to 
-				    // check.
-
-				    Instruction *v_I = cast<Instruction>(v);
-				    Value *flip = FlipRandomBit(v_I);
-				    I->setOperand(i,flip);
-				    
-				    dataInjCnt++;
-				    injected = true;
-				    break;
-				  }
-				
-			      } 
-			  }     
-			    
-		      }
-		    }
-		}	  
+		  fprintf(stderr,"No fault site %u, there are %u.\n",id,(unsigned)sites.size());
+		  return 1;
+		}
+	      chosen.push_back(sites[id-1]);
 	    }
-	} 
-    }
+	}
+      else
+	{
+	  if (NumErrors > sites.size())
+	    printf("Failed to insert requested number of errors.\n");
+	  std::mt19937 rng(Seed ? Seed : time(NULL));
+	  std::sample(sites.begin(), sites.end(), std::back_inserter(chosen), (unsigned)NumErrors, rng);
+	}
 
+      for (FaultSite &site : chosen)
+	{
+	  if (site.control)
+	    {
+	      // Invert the condition
+	      BranchInst *BI = cast<BranchInst>(site.I);
+	      Value *V = BI->getCondition();
+	      BinaryOperator *BO =
+		BinaryOperator::Create(Instruction::Xor,V,ConstantInt::get(V->getType(),1),"fi_inv",BI);
+	      BI->setCondition(BO);
+	      ctrlInjCnt++;
+	    }
+	  else
+	    {
+	      // flip a random bit of the operand, only for this use
+	      Instruction *v_I = cast<Instruction>(site.I->getOperand(site.operand));
+	      site.I->setOperand(site.operand,FlipRandomBit(v_I));
+	      dataInjCnt++;
+	    }
+	}
+    }
 
   legacy::PassManager Passes;
   Passes.add(createVerifierPass());
@@ -286,6 +327,120 @@ main (int argc, char ** argv)
 
 static FunctionCallee Flip;
 
+static bool isFaultSite(Instruction *I, unsigned &operand, bool &control)
+{
+  if (BranchInst *BI = dyn_cast<BranchInst>(I))
+    {
+      operand = 0;
+      control = true;
+      return !NoFlowInject && BI->isConditional();
+    }
+
+  if (NoDataInject)
+    return false;
+  for (unsigned i=0; i<I->getNumOperands(); i++)
+    {
+      Value *v = I->getOperand(i);
+      // the flip goes right after v, so v cannot end its block
+      if (isa<Instruction>(v) && !isa<PHINode>(v) && !cast<Instruction>(v)->isTerminator() &&
+	  v->getType()==IntegerType::get(Context,32))
+	{
+	  operand = i;
+	  control = false;
+	  return true;
+	}
+    }
+  return false;
+}
+
+// every site, in module order
+static void CollectSites(Module *M, std::vector<FaultSite> &sites)
+{
+  for (Function &F : *M)
+    {
+      if (F.getName() == "assert_ft" || F.getName() == "assert_cfg_ft" || F.getName()=="flip")
+	continue;
+      for (BasicBlock &BB : F)
+	for (Instruction &I : BB)
+	  {
+	    FaultSite site;
+	    site.I = &I;
+	    if (isFaultSite(&I, site.operand, site.control))
+	      sites.push_back(site);
+	  }
+    }
+}
+
+/*  Runtime-selected injection. Site i (numbered from 1 in module order) is
+    only active when @fi_fault_id == i; a constructor reads @fi_fault_id
+    from the FI_FAULT_ID environment variable, so 0 or unset runs the
+    program fault-free:
+      control:  br (cond ^ (fi_fault_id == i))
+      data:     v' = fi_fault_id == i ? flip(v) : v, right after v
+    Returns the number of control sites.
+*/
+static unsigned InstrumentSites(Module *M, std::vector<FaultSite> &sites)
+{
+  Type *i32 = IntegerType::get(Context,32);
+  // the fork server sets it in every child
+  GlobalVariable *faultId = new GlobalVariable(*M, i32, false,
+					       ForkServer.empty() ? GlobalValue::InternalLinkage : GlobalValue::ExternalLinkage,
+					       ConstantInt::get(i32,0), "fi_fault_id");
+
+  // void fi_read_fault_id() { char *s = getenv("FI_FAULT_ID"); if (s) fi_fault_id = atoi(s); }
+  {
+    Type *i8p = Type::getInt8PtrTy(Context);
+    FunctionCallee Getenv = M->getOrInsertFunction("getenv", FunctionType::get(i8p, {i8p}, false));
+    FunctionCallee Atoi = M->getOrInsertFunction("atoi", FunctionType::get(i32, {i8p}, false));
+    Function *F = Function::Create(FunctionType::get(Type::getVoidTy(Context), false),
+				   GlobalValue::InternalLinkage, "fi_read_fault_id", M);
+    BasicBlock *entry = BasicBlock::Create(Context,"entry",F);
+    BasicBlock *set = BasicBlock::Create(Context,"set",F);
+    BasicBlock *done = BasicBlock::Create(Context,"done",F);
+    IRBuilder<> Builder(entry);
+    Value *s = Builder.CreateCall(Getenv, {Builder.CreateGlobalStringPtr("FI_FAULT_ID")});
+    Builder.CreateCondBr(Builder.CreateIsNotNull(s), set, done);
+    Builder.SetInsertPoint(set);
+    Builder.CreateStore(Builder.CreateCall(Atoi, {s}), faultId);
+    Builder.CreateBr(done);
+    Builder.SetInsertPoint(done);
+    Builder.CreateRetVoid();
+    appendToGlobalCtors(*M, F, 0);
+  }
+
+  MDNode *unlikely = MDBuilder(Context).createBranchWeights(1, 2000);
+  unsigned ctrl = 0;
+  for (unsigned i=0; i<sites.size(); i++)
+    {
+      FaultSite &site = sites[i];
+      Constant *id = ConstantInt::get(i32, i+1);
+
+      if (site.control)
+	{
+	  BranchInst *BI = cast<BranchInst>(site.I);
+	  IRBuilder<> Builder(BI);
+	  Value *hit = Builder.CreateICmpEQ(Builder.CreateLoad(i32, faultId), id);
+	  BI->setCondition(Builder.CreateXor(BI->getCondition(), hit, "fi_inv"));
+	  ctrl++;
+	  continue;
+	}
+
+      Instruction *v = cast<Instruction>(site.I->getOperand(site.operand));
+      Instruction *after = &*++BasicBlock::iterator(v);
+      IRBuilder<> Builder(after);
+      Value *hit = Builder.CreateICmpEQ(Builder.CreateLoad(i32, faultId), id);
+      Instruction *then = SplitBlockAndInsertIfThen(hit, after, false, unlikely);
+      Builder.SetInsertPoint(then);
+      Value *flipped = Builder.CreateCall(Flip.getFunctionType(),Flip.getCallee(),{v},"flip");
+      Builder.SetInsertPoint(after);
+      PHINode *phi = Builder.CreatePHI(i32, 2, "fi_val");
+      phi->addIncoming(v, cast<Instruction>(hit)->getParent());
+      phi->addIncoming(flipped, then->getParent());
+      site.I->setOperand(site.operand, phi);
+    }
+  return ctrl;
+}
+
 Value *FlipRandomBit(Instruction *I)
 {
   BasicBlock::iterator it(I);
@@ -336,3 +491,16 @@ void  BuildFlip(Module *M)
   ret = Builder.CreateAnd(ret, ConstantInt::get(IntegerType::get(Context,32), 0x1F));
   Builder.CreateRet(Builder.CreateXor(F->getArg(0),Builder.CreateShl(ConstantInt::get(IntegerType::get(Context,32), 1), ret)));
 }
+
+// the first instruction of name becomes the fork server's marker
+static bool InsertForkServer(Module *M, StringRef name)
+{
+  Function *F = M->getFunction(name);
+  if (!F || F->empty())
+    return false;
+  FunctionCallee Server = M->getOrInsertFunction("fi_fork_server",
+						 FunctionType::get(Type::getVoidTy(Context), false));
+  IRBuilder<> Builder(&*F->getEntryBlock().getFirstInsertionPt());
+  Builder.CreateCall(Server);
+  return true;
+}
@@ -28,10 +28,17 @@
 #include "llvm/Analysis/InstructionSimplify.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/IR/InstVisitor.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Analysis/LoopAnalysisManager.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/Support/ThreadPool.h"
 //#include "llvm/Analysis/CGSCCAnalysisManager.h"
 //#include "llvm/Analysis/ModuleAnalysisManager.h"
 
@@ -39,6 +46,8 @@ using namespace llvm;
 
 extern FunctionCallee AssertFT;
 extern FunctionCallee AssertCFG;
+extern FunctionCallee AssertFail;
+extern cl::opt<unsigned> Jobs;
 
 void BuildExit(Module *M)
 {
@@ -141,6 +150,103 @@ FunctionCallee BuildAssertCFG(Module *M)
 
 }
 
+// Failure path of checks emitted inline, data and control-flow ones: a
+// cold, noreturn, noinline function that reports the check's UID and exits.
+FunctionCallee BuildAssertFail(Module *M)
+{
+  LLVMContext &Context = M->getContext();
+
+  std::vector<Type*> v;
+  v.push_back(IntegerType::get(M->getContext(),32));
+
+  ArrayRef<Type*> Params(v);
+  FunctionType* FunType = FunctionType::get(Type::getVoidTy(Context),Params,false);
+
+  FunctionCallee fun = M->getOrInsertFunction("assert_ft_fail",FunType);
+
+  Function *F = cast<Function>(fun.getCallee());
+  F->addFnAttr(Attribute::NoReturn);
+  F->addFnAttr(Attribute::NoInline);
+  F->addFnAttr(Attribute::Cold);
+
+  BasicBlock *BB1 = BasicBlock::Create(Context,"entry",F);
+  IRBuilder<> Builder(BB1);
+  std::vector<Value*> args;
+  Value* s = Builder.CreateGlobalStringPtr("**Possible soft-error detected by check %d. Exiting program.\n");
+  args.push_back(s);
+  args.push_back(F->getArg(0));
+  Builder.CreateCall(F->getParent()->getFunction("printf"),args,"assertcheck");
+  Builder.CreateCall(F->getParent()->getFunction("exit"),Builder.getInt32(1099));
+  Builder.CreateUnreachable();
+
+  return fun;
+}
+
+// Destructor that appends "<label> <count>" to path for every non-zero i64
+// in counts, labels[i] naming counts[i]. Appending lets several runs of a
+// program add up in one file.
+//   for (i = 0; i < N; i++)
+//     if (counts[i]) fprintf(f, "%s %llu\n", labels[i], counts[i]);
+void BuildCounterDump(Module *M, GlobalVariable *counts, ArrayRef<std::string> labels,
+                      StringRef path, StringRef name)
+{
+  LLVMContext &Context = M->getContext();
+  Type *i8p = Type::getInt8PtrTy(Context);
+  Type *i64 = Type::getInt64Ty(Context);
+  uint64_t N = labels.size();
+  if (N == 0)
+    return;
+
+  FunctionCallee fopenF = M->getOrInsertFunction("fopen", FunctionType::get(i8p, {i8p, i8p}, false));
+  FunctionCallee fprintfF = M->getOrInsertFunction("fprintf", FunctionType::get(Type::getInt32Ty(Context), {i8p}, true));
+  FunctionCallee fcloseF = M->getOrInsertFunction("fclose", FunctionType::get(Type::getInt32Ty(Context), {i8p}, false));
+
+  Function *F = Function::Create(FunctionType::get(Type::getVoidTy(Context), false),
+                                 GlobalValue::InternalLinkage, name, M);
+  BasicBlock *entry = BasicBlock::Create(Context, "entry", F);
+  BasicBlock *loop = BasicBlock::Create(Context, "loop", F);
+  BasicBlock *print = BasicBlock::Create(Context, "print", F);
+  BasicBlock *next = BasicBlock::Create(Context, "next", F);
+  BasicBlock *close = BasicBlock::Create(Context, "close", F);
+  BasicBlock *exit = BasicBlock::Create(Context, "exit", F);
+
+  IRBuilder<> Builder(entry);
+  std::vector<Constant*> strs;
+  for (const std::string &label : labels)
+    strs.push_back(Builder.CreateGlobalStringPtr(label, name + ".label"));
+  ArrayType *labelsTy = ArrayType::get(i8p, N);
+  GlobalVariable *labelsGV = new GlobalVariable(*M, labelsTy, true, GlobalValue::PrivateLinkage,
+                                                ConstantArray::get(labelsTy, strs), name + ".labels");
+
+  Value *f = Builder.CreateCall(fopenF, {Builder.CreateGlobalStringPtr(path), Builder.CreateGlobalStringPtr("a")});
+  Builder.CreateCondBr(Builder.CreateIsNull(f), exit, loop);
+
+  Builder.SetInsertPoint(loop);
+  PHINode *i = Builder.CreatePHI(i64, 2, "i");
+  i->addIncoming(Builder.getInt64(0), entry);
+  Value *count = Builder.CreateLoad(i64, Builder.CreateInBoundsGEP(counts->getValueType(), counts, {Builder.getInt64(0), i}));
+  Builder.CreateCondBr(Builder.CreateIsNotNull(count), print, next);
+
+  Builder.SetInsertPoint(print);
+  Value *label = Builder.CreateLoad(i8p, Builder.CreateInBoundsGEP(labelsTy, labelsGV, {Builder.getInt64(0), i}));
+  Builder.CreateCall(fprintfF, {f, Builder.CreateGlobalStringPtr("%s %llu\n"), label, count});
+  Builder.CreateBr(next);
+
+  Builder.SetInsertPoint(next);
+  Value *inext = Builder.CreateAdd(i, Builder.getInt64(1));
+  i->addIncoming(inext, next);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(inext, Builder.getInt64(N)), close, loop);
+
+  Builder.SetInsertPoint(close);
+  Builder.CreateCall(fcloseF, {f});
+  Builder.CreateBr(exit);
+
+  Builder.SetInsertPoint(exit);
+  Builder.CreateRetVoid();
+
+  appendToGlobalDtors(*M, F, 0);
+}
+
 void  BuildHelperFunctions(Module *M)
 {
   BuildExit(M);
@@ -150,10 +256,30 @@ void  BuildHelperFunctions(Module *M)
   AssertCFG = BuildAssertCFG(M);  
 }
 
+enum PipelineLevel { LevelO0, LevelO1, LevelO2, LevelO3, LevelOs, LevelOz };
+
+static cl::opt<PipelineLevel>
+        PipelineOptLevel("opt-level",
+              cl::desc("Default pipeline RunO2 runs."),
+              cl::values(clEnumValN(LevelO0, "O0", "no optimization"),
+                         clEnumValN(LevelO1, "O1", "-O1"),
+                         clEnumValN(LevelO2, "O2", "-O2"),
+                         clEnumValN(LevelO3, "O3", "-O3"),
+                         clEnumValN(LevelOs, "Os", "-Os"),
+                         clEnumValN(LevelOz, "Oz", "-Oz")),
+              cl::init(LevelO2));
+
+static cl::opt<std::string>
+        PassPipeline("passes",
+              cl::desc("Textual pass pipeline run instead of -opt-level, e.g. 'function(sroa,instcombine,gvn)'."),
+              cl::init(""));
+
 //
-// Run all O2 optimizations
+// Run all O2 optimizations, or the pipeline picked with -opt-level or
+// -passes. With LLVM's -time-passes, the time of every pass is reported
+// under a heading naming the run (before or after SWFT).
 //
-void RunO2(Module *M) {
+void RunO2(Module *M, StringRef when) {
   // Create the analysis managers.
   // These must be declared in this order so that they are destroyed in the
   // correct order due to inter-analysis-manager references.
@@ -161,12 +287,18 @@ void RunO2(Module *M) {
   FunctionAnalysisManager FAM;
   CGSCCAnalysisManager CGAM;
   ModuleAnalysisManager MAM;
+
+  // per-pass timers, printed when this run is done
+  PassInstrumentationCallbacks PIC;
+  TimePassesHandler TimePasses(TimePassesIsEnabled);
+  TimePasses.setOutStream(errs());
+  TimePasses.registerCallbacks(PIC);
   
   // Create the new pass manager builder.
   // Take a look at the PassBuilder constructor parameters for more
   // customization, e.g. specifying a TargetMachine or various debugging
   // options.
-  PassBuilder PB;
+  PassBuilder PB(nullptr, PipelineTuningOptions(), {}, &PIC);
   
   // Register all the basic analyses with the managers.
   PB.registerModuleAnalyses(MAM);
@@ -176,8 +308,25 @@ void RunO2(Module *M) {
   PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
   
   // Create the pass manager.
-  // This one corresponds to a typical -O2 optimization pipeline.
-  ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O2);
+  ModulePassManager MPM;
+  if (!PassPipeline.empty()) {
+    if (Error Err = PB.parsePassPipeline(MPM, PassPipeline)) {
+      errs() << "-passes: " << toString(std::move(Err)) << "\n";
+      exit(1);
+    }
+  } else {
+    static const OptimizationLevel Levels[] = {
+      OptimizationLevel::O0, OptimizationLevel::O1, OptimizationLevel::O2,
+      OptimizationLevel::O3, OptimizationLevel::Os, OptimizationLevel::Oz };
+    OptimizationLevel Level = Levels[PipelineOptLevel];
+    if (Level == OptimizationLevel::O0)
+      MPM = PB.buildO0DefaultPipeline(Level);
+    else
+      MPM = PB.buildPerModuleDefaultPipeline(Level);
+  }
+
+  if (TimePassesIsEnabled)
+    errs() << "===== p3 pipeline " << when << " =====\n";
   
   // Optimize the IR!
   MPM.run(*M, MAM);
@@ -194,7 +343,9 @@ static llvm::Statistic cfgCoverage = {"", "cfgEdgeCoverage", "number of protecte
 
 struct AssertVisitor : public InstVisitor<AssertVisitor> {
   std::vector<CallInst*> ft;
-  std::vector<CallInst*> cfg;  
+  std::vector<Instruction*> cfg;   // calls to assert_cfg_ft, inline cfg checks
+  std::vector<ICmpInst*> inlined;  // compares guarding inline checks
+  std::vector<Instruction*> votes; // -tmr majority votes
     
   unsigned Count;
   AssertVisitor() {}
@@ -207,44 +358,88 @@ struct AssertVisitor : public InstVisitor<AssertVisitor> {
       cfg.push_back(&CI);
 
   }
-};
 
-struct CollectInst : public InstVisitor<CollectInst> {
-  std::set<Instruction*> s;
-    
-  unsigned Count;
-  CollectInst() {}
-  
+  // an inline check branches to a block that calls assert_ft_fail; the
+  // ones of control-flow checks are marked !ft.cfg
+  void visitBranchInst(BranchInst &BI) {
+    if (BI.getMetadata("ft.cfg")) {
+      cfg.push_back(&BI);
+      return;
+    }
+    if (!AssertFail || !BI.isConditional() || !isa<ICmpInst>(BI.getCondition()))
+      return;
+    for (BasicBlock *Succ : BI.successors()) {
+      CallInst *CI = dyn_cast<CallInst>(Succ->getFirstNonPHI());
+      if (CI && CI->getCalledFunction() == AssertFail.getCallee()) {
+        inlined.push_back(cast<ICmpInst>(BI.getCondition()));
+        return;
+      }
+    }
+  }
+
   void visitInstruction(Instruction &I) {
-    s.insert(&I);
+    if (I.getMetadata("ft.vote"))
+      votes.push_back(&I);
   }
 };
 
+/*  Coverage is computed per function: every instruction of a function gets
+    a dense number, so a backtrace is a BitVector instead of a set of
+    pointers, and the walks use explicit worklists so long def-use chains
+    cannot overflow the stack. Functions are independent and run on -j
+    threads.
+*/
+struct FunctionCoverage {
+  Function *F = nullptr;
+  std::vector<CallInst*> ft;
+  std::vector<Instruction*> cfg;
+  std::vector<ICmpInst*> inlined;
+  std::vector<Instruction*> votes;
+  long insts = 0;
+  long edges = 0;
+};
 
+struct InstNumbering {
+  DenseMap<Instruction*, unsigned> index;
 
-void backtrace(Instruction *I, std::set<Instruction*> &bt) {
-  if (bt.find(I) == bt.end()) {
-    bt.insert(I);
-    for (int i=0; i<I->getNumOperands(); i++) {
-      Value* op = I->getOperand(i);
-      if ( isa<Instruction>(op) ) {
-	backtrace(cast<Instruction>(op),bt);
-      }
-    }
+  InstNumbering(Function *F) {
+    for (Instruction &I : instructions(F))
+      index[&I] = index.size();
   }
-}
+};
 
-PHINode *get_phi(Instruction *I) {
-  if ( isa<PHINode>(I) ) return cast<PHINode>(I);
+// sets the bit of I and of everything it transitively uses
+static void backtrace(Instruction *I, const InstNumbering &N, BitVector &bt,
+                      SmallVectorImpl<Instruction*> &worklist) {
+  worklist.push_back(I);
+  while (!worklist.empty()) {
+    Instruction *J = worklist.pop_back_val();
+    unsigned idx = N.index.lookup(J);
+    if (bt.test(idx))
+      continue;
+    bt.set(idx);
+    for (Value *op : J->operands())
+      if (Instruction *opI = dyn_cast<Instruction>(op))
+        worklist.push_back(opI);
+  }
+}
 
-  for (int i=0; i<I->getNumOperands(); i++) {
-    Value* op = I->getOperand(i);
-    if ( isa<Instruction>(op) ) {
-      PHINode *phi = get_phi(cast<Instruction>(op));
-      if (phi) { return phi; }
-    }
+// the first phi found depth-first through the operands, as the recursive walk did
+static PHINode *get_phi(Instruction *I, const InstNumbering &N) {
+  BitVector visited(N.index.size());
+  SmallVector<Instruction*, 32> stack = {I};
+  while (!stack.empty()) {
+    Instruction *J = stack.pop_back_val();
+    unsigned idx = N.index.lookup(J);
+    if (visited.test(idx))
+      continue;
+    visited.set(idx);
+    if (PHINode *phi = dyn_cast<PHINode>(J))
+      return phi;
+    for (unsigned i = J->getNumOperands(); i-- > 0;)
+      if (Instruction *opI = dyn_cast<Instruction>(J->getOperand(i)))
+        stack.push_back(opI);
   }
-  
   return nullptr;
 }
 
@@ -259,63 +454,106 @@ long cfg_edges(Function *F) {
   return cfg_edges;
 }
 
-long branch_coverage(std::vector<CallInst*> &seed)
+static void branch_coverage(FunctionCoverage &FC, const InstNumbering &N)
 {
-  std::set< std::pair<BasicBlock*,BasicBlock*> > edges;
-
-  std::set<Instruction*> branchs;
-  for (CallInst* CI: seed) {
-    PHINode *phi = get_phi(CI);
-    BasicBlock *pbb = phi->getParent();
-    if (phi) {
-      // for each arg in phi:
-      for (int i=0; i<phi->getNumIncomingValues(); i++) {
-	BasicBlock *bb = phi->getIncomingBlock(i);
-	edges.insert( {bb,pbb} );
-      }
-    }    
+  // every edge whose signature update flows into a checked value
+  BitVector bt(N.index.size());
+  SmallVector<Instruction*, 32> worklist;
+  for (Instruction *check: FC.cfg) {
+    PHINode *phi = get_phi(check, N);
+    if (phi)
+      backtrace(phi, N, bt, worklist);
   }
 
-  return edges.size();
+  DenseSet<std::pair<BasicBlock*,BasicBlock*>> edges;
+  for (Instruction &I : instructions(FC.F)) {
+    PHINode *p = dyn_cast<PHINode>(&I);
+    if (!p || !bt.test(N.index.lookup(p))) continue;
+    for (unsigned i=0; i<p->getNumIncomingValues(); i++)
+      edges.insert( {p->getIncomingBlock(i),p->getParent()} );
+  }
+  FC.edges = edges.size();
 }
 
-long instruction_coverage(std::vector<CallInst*> &seed) {
-  std::set<Instruction*> bt;
-  for (auto I: seed) {
-    Instruction * val;
-    if (I->getNumOperands() > 0) {
-      val = cast<Instruction>(I->getOperand(0));
-      if (val && val->getNumOperands() > 0)
-	{
-	  val = cast<Instruction>(val->getOperand(0));
-	  if (val && isa<ICmpInst>(val)) {
-	    // don't add I
-	    for (int i=0; i<val->getNumOperands(); i++) {
-	      Value* op = val->getOperand(i);
-	      if ( isa<Instruction>(op) ) {
-		backtrace(cast<Instruction>(op),bt);
-	      }
-	    }
-	  }
-	}
-    }
+static void instruction_coverage(FunctionCoverage &FC, const InstNumbering &N) {
+  BitVector bt(N.index.size());
+  SmallVector<Instruction*, 32> worklist;
+  auto backtrace_operands = [&](Instruction *cmp) {
+    for (Value *op : cmp->operands())
+      if (Instruction *opI = dyn_cast<Instruction>(op))
+        backtrace(opI, N, bt, worklist);
+  };
+
+  for (ICmpInst *cmp: FC.inlined)
+    backtrace_operands(cmp);
+  // the copies going into a vote, not the vote itself
+  for (Instruction *vote: FC.votes)
+    for (Value *op : vote->operands())
+      if (Instruction *opI = dyn_cast<Instruction>(op))
+        if (!opI->getMetadata("ft.vote"))
+          backtrace(opI, N, bt, worklist);
+  for (CallInst *I: FC.ft) {
+    if (I->getNumOperands() == 0)
+      continue;
+    // optimized code may pass a constant or fold away the zext
+    Instruction *val = dyn_cast<Instruction>(I->getOperand(0));
+    if (val && isa<ZExtInst>(val))
+      val = dyn_cast<Instruction>(val->getOperand(0));
+    // don't add the check itself
+    if (val && isa<ICmpInst>(val))
+      backtrace_operands(val);
   }
-  return bt.size();
+  FC.insts = bt.count();
 }
 
 
 double estimate_fault_coverage(Module *M) {
-  double cov = 0.0;
-
   AssertVisitor av;
   av.visit(M);
-  CollectInst s;
-  s.visit(M);
 
-  long total = s.s.size();
-  long ft_cov = instruction_coverage(av.ft);
+  std::vector<FunctionCoverage> funcs;
+  DenseMap<Function*, unsigned> funcIndex;
+  auto coverageOf = [&](Instruction *I) -> FunctionCoverage & {
+    auto it = funcIndex.try_emplace(I->getFunction(), funcs.size());
+    if (it.second) {
+      funcs.emplace_back();
+      funcs.back().F = I->getFunction();
+    }
+    return funcs[it.first->second];
+  };
+  for (CallInst *CI : av.ft)
+    coverageOf(CI).ft.push_back(CI);
+  for (Instruction *check : av.cfg)
+    coverageOf(check).cfg.push_back(check);
+  for (ICmpInst *cmp : av.inlined)
+    coverageOf(cmp).inlined.push_back(cmp);
+  for (Instruction *vote : av.votes)
+    coverageOf(vote).votes.push_back(vote);
+
+  auto run = [](FunctionCoverage &FC) {
+    InstNumbering N(FC.F);
+    instruction_coverage(FC, N);
+    branch_coverage(FC, N);
+  };
+  if (Jobs == 1 || funcs.size() < 2) {
+    for (FunctionCoverage &FC : funcs)
+      run(FC);
+  } else {
+    ThreadPool Pool(hardware_concurrency(Jobs));
+    for (FunctionCoverage &FC : funcs)
+      Pool.async([&run, &FC] { run(FC); });
+    Pool.wait();
+  }
+
+  long total = M->getInstructionCount();
+  long ft_cov = 0;
+  long cfg_cov = 0;
+  for (FunctionCoverage &FC : funcs) {
+    ft_cov += FC.insts;
+    cfg_cov += FC.edges;
+  }
 
-  cfgCoverage = branch_coverage(av.cfg);
+  cfgCoverage = cfg_cov;
 
   instCoverage = ft_cov;
 
@@ -324,8 +562,7 @@ double estimate_fault_coverage(Module *M) {
   if (total==0)
     return 0.0;
   
-  cov = (double)(ft_cov)/(double)total;
-  return cov;   
+  return (double)(ft_cov)/(double)total;
 }
 
 
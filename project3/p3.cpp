@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <set>
 #include <vector>
+#include <tuple>
 #include <utility>
 #include <map>
 #include <unordered_map>
@@ -19,6 +20,11 @@
 #include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/ADT/StringSet.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/PostOrderIterator.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/ToolOutputFile.h"
@@ -27,14 +33,26 @@
 #include "llvm/LinkAllPasses.h"
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Analysis/InstructionSimplify.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/IR/InstVisitor.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Analysis/LoopAnalysisManager.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 //#include "llvm/Analysis/CGSCCAnalysisManager.h"
 //#include "llvm/Analysis/ModuleAnalysisManager.h"
 
@@ -50,6 +68,7 @@ LLVMContext& getGlobalContext() {
 
 
 static void SoftwareFaultTolerance(Module *);
+static void RedundantMultithreading(Module *);
 
 static void print_csv_file(std::string outputfile);
 
@@ -92,15 +111,138 @@ static cl::opt<bool>
               cl::desc("Do not perform control flow protection."),
               cl::init(false));
 
+static cl::opt<bool>
+        SimdDup("simd-dup",
+              cl::desc("Run an i32/i64 arithmetic instruction and its clone as one <2 x iN> vector "
+                       "instruction, original in lane 0 and clone in lane 1."),
+              cl::init(false));
+
+enum CheckPlacement { EveryInst, SyncPoints, BlockSignature, LoopAccumulated };
+
+static cl::opt<bool>
+        InlineChecks("inline-checks",
+              cl::desc("Emit checks as a compare and a branch to one shared failure block per function "
+                       "instead of a call to assert_ft."),
+              cl::init(false));
+
+static cl::opt<CheckPlacement>
+        Checks("swft-checks",
+              cl::desc("Where cloned values are compared with the originals."),
+              cl::values(clEnumValN(EveryInst, "every", "after every cloned instruction"),
+                         clEnumValN(SyncPoints, "sync", "only where values leave the duplicated code: stored values "
+                                                        "and addresses, branch conditions, call arguments and return values"),
+                         clEnumValN(BlockSignature, "block", "OR together orig^clone of a block's values and compare once, "
+                                                             "before the next side effect or the terminator"),
+                         clEnumValN(LoopAccumulated, "loop", "like block, but carry the accumulator through each loop and "
+                                                            "check it at the loop exits and before stores and calls")),
+              cl::init(EveryInst));
+
+static cl::opt<bool>
+        ElimRedundantChecks("elim-redundant-checks",
+              cl::desc("Remove checks already covered by a dominating check of the same values or by "
+                       "the check of the value's only user."),
+              cl::init(false));
+
+static cl::opt<bool>
+        ReOpt("reopt",
+              cl::desc("Hide the clones from value-based optimizations and run O2 again on the protected module."),
+              cl::init(false));
 
+cl::opt<unsigned>
+        Jobs("j",
+              cl::desc("Threads used to analyze the functions before they are protected, and to "
+                       "estimate the coverage afterwards (0 = all cores)."),
+              cl::init(1));
 
-void RunO2(Module *M);
+static cl::opt<unsigned>
+        ProtectBudget("protect-budget",
+              cl::desc("Only replicate this percentage of the module's replicable instructions, the "
+                       "ones ranked most likely to turn a fault into silent corruption."),
+              cl::value_desc("percent"),
+              cl::init(100));
+
+static cl::opt<std::string>
+        ProfileGen("profile-gen",
+              cl::desc("Instead of protecting the program, count how often each block runs and append "
+                       "the counts to <file> when the program exits, for -profile-use."),
+              cl::value_desc("file"),
+              cl::init(""));
+
+static cl::opt<std::string>
+        ProfileUse("profile-use",
+              cl::desc("Place checks by block counts from runs of a -profile-gen build, or with 'ir' from "
+                       "the !prof metadata of clang -fprofile-instr-use: hot blocks only get sync-point "
+                       "checks, cold ones a check after every cloned instruction. Overrides -swft-checks."),
+              cl::value_desc("file"),
+              cl::init(""));
+
+static cl::opt<unsigned>
+        ProfileHot("profile-hot",
+              cl::desc("Hot blocks are the most frequently run blocks that together make up this "
+                       "percentage of the profiled instructions."),
+              cl::value_desc("percent"),
+              cl::init(90));
+
+static cl::opt<bool>
+        Tmr("tmr",
+              cl::desc("Triple modular redundancy: clone instructions twice and, where -swft-checks would "
+                       "check them, replace the value with the majority of its three copies, so a single "
+                       "corrupted copy is outvoted and the program keeps running. With -swft-checks=block "
+                       "or loop the votes are at the sync points."),
+              cl::init(false));
+
+static cl::opt<std::string>
+        TmrVotes("tmr-votes",
+              cl::desc("With -tmr, count how often each vote outvoted a copy and append the counts to "
+                       "<file> when the program exits, as <function> <uid> <count>."),
+              cl::value_desc("file"),
+              cl::init(""));
+
+static cl::opt<std::string>
+        CheckProfile("check-profile",
+              cl::desc("Count how often each check runs, with a relaxed atomic add at the check, and "
+                       "append the counts to <file> when the program exits, as <function> <block> <uid> "
+                       "<data|cfg> <count>. <block> is the block the check was made for, by name or as "
+                       "#<position> in its function. Rank the sites with checkprof."),
+              cl::value_desc("file"),
+              cl::init(""));
+
+static cl::opt<bool>
+        Srmt("srmt",
+              cl::desc("Redundant multithreading instead of duplicating instructions: a trailing thread runs a "
+                       "second copy of the protected functions and verifies what the leading thread sends it "
+                       "at loads, stores, branches and calls. Link the program with runtime/srmt.c and -lpthread."),
+              cl::init(false));
+
+enum CfgCheckPlacement { CfgExits, CfgLoops, CfgAll };
+
+static cl::opt<CfgCheckPlacement>
+        CfgChecks("cfg-checks",
+              cl::desc("Blocks where the control-flow signature is checked."),
+              cl::values(clEnumValN(CfgExits, "exits", "function exits"),
+                         clEnumValN(CfgLoops, "loops", "loop headers and function exits"),
+                         clEnumValN(CfgAll, "all", "every block")),
+              cl::init(CfgLoops));
+
+
+
+void RunO2(Module *M, StringRef when);
 void BuildHelperFunctions(Module *);
 void summarize(Module *M);
+void BuildCounterDump(Module *M, GlobalVariable *counts, ArrayRef<std::string> labels,
+                      StringRef path, StringRef name);
+FunctionCallee BuildAssertFail(Module *M);
 FunctionCallee AssertFT;
 FunctionCallee AssertCFG;
-static void CloneInstAndSetOperands(Function *passed_func);
-static void VerifyCfg(Function *passed_func);
+FunctionCallee AssertFail;
+static void CloneInstAndSetOperands(Function *passed_func, const DenseSet<Instruction*> &skip);
+static void PackClonesIntoLanes(Function *passed_func);
+static void InsertSyncPointChecks(Function *passed_func, const DenseSet<Instruction*> *only,
+                                  const DenseSet<Instruction*> &skip);
+static void InsertBlockSignatureChecks(Function *passed_func);
+static void VerifyCfg(Function *passed_func, const std::vector<BasicBlock*> &loopHeaders);
+static Value *OpaqueCopy(Value *v, Instruction *insertPt, unsigned apart = 0);
+static void InstrumentBlockCounts(Module *M);
 
 int main(int argc, char **argv) {
     // Parse command line arguments
@@ -130,13 +272,30 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    if (Tmr && SimdDup) {
+        errs() << argv[0] << ": -tmr cannot be combined with -simd-dup\n";
+        return 1;
+    }
+
+    if (Srmt && !CheckProfile.empty()) {
+        errs() << argv[0] << ": -check-profile cannot be combined with -srmt\n";
+        return 1;
+    }
+
     // Run O2 optimizations
-    RunO2(M.get());
+    RunO2(M.get(), "before SWFT");
 
     BuildHelperFunctions(M.get());      
     
-    if (!NoSWFT) {
-      SoftwareFaultTolerance(M.get());
+    if (!ProfileGen.empty()) {
+      InstrumentBlockCounts(M.get());
+    } else if (!NoSWFT) {
+      if (Srmt)
+        RedundantMultithreading(M.get());
+      else
+        SoftwareFaultTolerance(M.get());
+      if (ReOpt)
+        RunO2(M.get(), "after SWFT");
     }
 
     // Collect statistics on Module
@@ -172,6 +331,11 @@ static void print_csv_file(std::string outputfile)
 }
 
 static llvm::Statistic SWFTAdded = {"", "SWFTadd", "SWFT added instructions"};
+static llvm::Statistic SWFTRedundant = {"", "SWFTRedundant", "redundant checks removed"};
+static llvm::Statistic SWFTSkipped = {"", "SWFTSkipped", "replicable instructions left unprotected by -protect-budget"};
+static llvm::Statistic SWFTVotes = {"", "SWFTVotes", "majority votes inserted by -tmr"};
+static llvm::Statistic ProfileHotBlocks = {"", "ProfileHotBlocks", "blocks only given sync-point checks by -profile-use"};
+static llvm::Statistic SWFTDynOverhead = {"", "SWFTDynOverhead", "estimated dynamic instruction overhead in percent, from the -profile-use counts"};
 /*  cloneMap = {} // empty map, use O(1) lookup
     for all instructions, i:
       if okay to clone i:
@@ -188,109 +352,1791 @@ static llvm::Statistic SWFTAdded = {"", "SWFTadd", "SWFT added instructions"};
 */
 
 //Global Variables and structres
-map<Instruction*, Instruction*> cloneMap;
+// clones of the function being protected, functions are done one by one
+DenseMap<Instruction*, Instruction*> cloneMap;
+// -tmr: the second clones
+DenseMap<Instruction*, Instruction*> cloneMap2;
+map<Function*, BasicBlock*> failBlocks;
 uint32_t my_UID = 1760;
 std::vector<llvm::Type*> arg_for_assert;
 
-static void CloneInstAndSetOperands(Function *passed_func){
-  bool doNotReplicateInst;
+//These instructions should not be repliacted
+static bool isReplicable(Instruction &inst) {
+  return !isa<AllocaInst>(inst) && !isa<StoreInst>(inst) && !isa<CallInst>(inst) && !inst.isTerminator();
+}
+
+static void CloneInstAndSetOperands(Function *passed_func, const DenseSet<Instruction*> &skip){
   //Insert instructions in cloneMap
   for (BasicBlock &bscblk : *passed_func) {
 
     for (auto inst = bscblk.begin(); inst != bscblk.end(); inst++) {
-      doNotReplicateInst = false;
-
-      //These instructions should not be repliacted
-      if( (isa<AllocaInst>(*inst)) || (isa<StoreInst>(*inst)) || (isa<CallInst>(*inst)) || inst->isTerminator() || (isa<ReturnInst>(*inst)) ||
-          (isa<CallInst>(*inst)) || (isa<BranchInst>(*inst)))
-      {
-        doNotReplicateInst = true;
-      }
-
-      if(doNotReplicateInst)
+      if(!isReplicable(*inst) || skip.count(&*inst))
         continue;
       else if(dyn_cast<Instruction>(inst) != nullptr){
 
         auto clone = inst->clone();
         clone->insertBefore(&*inst);
         cloneMap.insert( {dyn_cast<Instruction>(inst), clone} );
+        if (Tmr) {
+          auto clone2 = inst->clone();
+          clone2->insertBefore(&*inst);
+          cloneMap2.insert( {dyn_cast<Instruction>(inst), clone2} );
+        }
       }
     }
   }//Instructions added in cloneMap
 
   // set operands of the cloned instruction if that operand is an instruction itself
-  if(!cloneMap.empty()){
-    for (const auto& c : cloneMap) {
-      //iterate through the map, for every cloned instruction's operands
-      Instruction* clonedInst = c.second;
-      for(unsigned op=0; op < clonedInst->getNumOperands(); op++){
-          Value* cloneI_operand = clonedInst->getOperand(op); // --> getOperand(c,i)
-          Instruction *inst_op = dyn_cast<Instruction>(cloneI_operand);
-
-          if(inst_op != NULL){
-            if(cloneMap.count(inst_op) > 0)
-              clonedInst->setOperand(op, cloneMap[inst_op]);  // --> clone->setOperand(0, newOperand);
+  // (in program order, so the use lists come out the same on every run)
+  for (DenseMap<Instruction*, Instruction*> *map : {&cloneMap, &cloneMap2}) {
+    for (BasicBlock &bscblk : *passed_func) {
+      for (Instruction &inst : bscblk) {
+        auto c = map->find(&inst);
+        if (c == map->end())
+          continue;
+        //for every cloned instruction's operands
+        Instruction* clonedInst = c->second;
+        for(unsigned op=0; op < clonedInst->getNumOperands(); op++){
+            Value* cloneI_operand = clonedInst->getOperand(op); // --> getOperand(c,i)
+            Instruction *inst_op = dyn_cast<Instruction>(cloneI_operand);
+
+            if(inst_op != NULL){
+              if(map->count(inst_op) > 0)
+                clonedInst->setOperand(op, (*map)[inst_op]);  // --> clone->setOperand(0, newOperand);
+            }
+
+          }
+      }
+    }
+  }
+}
+
+
+/*  SIMD-lane duplication: an original and its clone that compute the same
+    i32/i64 arithmetic are replaced by one <2 x iN> instruction with the
+    original in lane 0 and the clone in lane 1:
+      %a.v = add <2 x i32> %x.v, %y.v
+      %a.c = extractelement <2 x i32> %a.v, i32 1
+      %a   = extractelement <2 x i32> %a.v, i32 0
+    Operands that are packed already are used directly, so a chain of
+    arithmetic (and the phis carrying it around loops) stays in vector
+    registers; other operands are packed with two insertelements. The lane
+    extracts take the place of the original and the clone in cloneMap, so
+    the checks compare lanes. Extracts nobody uses are removed by
+    DropUnusedLanes once the checks are in.
+*/
+std::vector<Instruction*> laneExtracts;
+
+static bool isLanePackable(Instruction *orig) {
+  if (cloneMap.count(orig) == 0)
+    return false;
+  if (!orig->getType()->isIntegerTy(32) && !orig->getType()->isIntegerTy(64))
+    return false;
+  if (isa<PHINode>(orig))
+    return true;
+  switch (orig->getOpcode()) {
+  case Instruction::Add: case Instruction::Sub: case Instruction::Mul:
+  case Instruction::And: case Instruction::Or: case Instruction::Xor:
+  case Instruction::Shl: case Instruction::LShr: case Instruction::AShr:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// <orig, clone> as one vector. Values are packed once, right after they
+// are defined, so every later use shares the same pair of insertelements.
+static Value *PackLanes(Value *orig, Value *clone, Instruction *insertPt,
+                        std::map<Value*, Value*> &packed) {
+  auto it = packed.find(orig);
+  if (it != packed.end())
+    return it->second;
+  if (isa<Constant>(orig) && isa<Constant>(clone))
+    return ConstantVector::get({cast<Constant>(orig), cast<Constant>(clone)});
+
+  Instruction *def = dyn_cast<Instruction>(orig);
+  auto c = def ? cloneMap.find(def) : cloneMap.end();
+  bool shared = true;
+  if (isa<Argument>(orig) && orig == clone)
+    insertPt = &*insertPt->getFunction()->getEntryBlock().getFirstInsertionPt();
+  else if (def && !def->isTerminator() && (c == cloneMap.end() ? orig == clone : c->second == clone))
+    insertPt = isa<PHINode>(def) ? &*def->getParent()->getFirstInsertionPt() : def->getNextNode();
+  else
+    shared = false;
+
+  IRBuilder<> Builder(insertPt);
+  // a value shared by both lanes would make them provably equal to O2
+  if (ReOpt && orig == clone)
+    clone = OpaqueCopy(clone, insertPt);
+  Value *v = PoisonValue::get(FixedVectorType::get(orig->getType(), 2));
+  v = Builder.CreateInsertElement(v, orig, (uint64_t)0);
+  v = Builder.CreateInsertElement(v, clone, (uint64_t)1);
+  if (shared)
+    packed[orig] = v;
+  return v;
+}
+
+static void PackClonesIntoLanes(Function *passed_func) {
+  // keyed by the original scalar, which stays valid until the very end
+  std::map<Value*, Value*> packed;
+  std::vector<Instruction*> packedOrig;
+  std::vector<PHINode*> phis;
+
+  ReversePostOrderTraversal<Function*> RPOT(passed_func);
+  for (BasicBlock *bscblk : RPOT) {
+    for (Instruction &inst : *bscblk) {
+      Instruction *orig = &inst;
+      if (!isLanePackable(orig))
+        continue;
+      Instruction *clone = cloneMap[orig];
+      Type *vecTy = FixedVectorType::get(orig->getType(), 2);
+      Value *v;
+      if (PHINode *phi = dyn_cast<PHINode>(orig)) {
+        PHINode *vphi = PHINode::Create(vecTy, phi->getNumIncomingValues(), orig->getName() + ".v", phi);
+        phis.push_back(phi);
+        v = vphi;
+      } else {
+        Value *lhs = PackLanes(orig->getOperand(0), clone->getOperand(0), orig, packed);
+        Value *rhs = PackLanes(orig->getOperand(1), clone->getOperand(1), orig, packed);
+        BinaryOperator *bin = BinaryOperator::Create(cast<BinaryOperator>(orig)->getOpcode(), lhs, rhs,
+                                                     orig->getName() + ".v", orig);
+        bin->copyIRFlags(orig);
+        v = bin;
+      }
+      packed[orig] = v;
+      packedOrig.push_back(orig);
+    }
+  }
+
+  // incoming values only now, the back edges are packed as well
+  for (PHINode *phi : phis) {
+    PHINode *vphi = cast<PHINode>(packed[phi]);
+    PHINode *clone = cast<PHINode>(cloneMap[phi]);
+    for (unsigned i = 0; i < phi->getNumIncomingValues(); i++) {
+      BasicBlock *pred = phi->getIncomingBlock(i);
+      vphi->addIncoming(PackLanes(phi->getIncomingValue(i), clone->getIncomingValueForBlock(pred),
+                                  pred->getTerminator(), packed), pred);
+    }
+  }
+
+  for (Instruction *orig : packedOrig) {
+    Instruction *clone = cloneMap[orig];
+    Instruction *insertPt = isa<PHINode>(orig) ? orig->getParent()->getFirstNonPHI() : orig;
+    IRBuilder<> Builder(insertPt);
+    // clone lane first, so a check placed right after the original lane
+    // sees both
+    Instruction *cloneLane = cast<Instruction>(Builder.CreateExtractElement(packed[orig], (uint64_t)1, clone->getName()));
+    Instruction *origLane = cast<Instruction>(Builder.CreateExtractElement(packed[orig], (uint64_t)0));
+    origLane->takeName(orig);
+    clone->replaceAllUsesWith(cloneLane);
+    orig->replaceAllUsesWith(origLane);
+    cloneMap.erase(orig);
+    cloneMap[origLane] = cloneLane;
+    laneExtracts.push_back(origLane);
+    clone->eraseFromParent();
+    orig->eraseFromParent();
+  }
+}
+
+static void DropUnusedLanes() {
+  for (Instruction *origLane : laneExtracts) {
+    Instruction *cloneLane = cloneMap[origLane];
+    if (!cloneLane->use_empty())
+      continue;
+    cloneMap.erase(origLane);
+    cloneLane->eraseFromParent();
+    if (origLane->use_empty())
+      origLane->eraseFromParent();
+  }
+  laneExtracts.clear();
+}
+
+//check the cloned or original instruction is of integer or pointer type
+static bool isCheckable(Value *v) {
+  return v->getType()->isIntegerTy() || v->getType()->isPointerTy();
+}
+
+// where checks of a block's phis go: after the phis, and after the -reopt
+// barriers that hide the cloned ones
+static Instruction *AfterPhis(BasicBlock *bscblk) {
+  Instruction *insertPt = &*bscblk->getFirstInsertionPt();
+  while (isa<CallInst>(insertPt) && cast<CallInst>(insertPt)->isInlineAsm())
+    insertPt = insertPt->getNextNode();
+  return insertPt;
+}
+
+// The failure block shared by the inline checks of a function:
+//   ft.fail: %ft.uid = phi i32 [uid of each check, ...]
+//            call @assert_ft_fail(i32 %ft.uid) ; cold, noreturn
+//            unreachable
+static BasicBlock *GetFailBlock(Function *F) {
+  BasicBlock *&fail = failBlocks[F];
+  if (fail == nullptr) {
+    fail = BasicBlock::Create(F->getContext(), "ft.fail", F);
+    IRBuilder<> Builder(fail);
+    PHINode *uid = Builder.CreatePHI(Builder.getInt32Ty(), 0, "ft.uid");
+    Builder.CreateCall(AssertFail, {uid})->setDoesNotReturn();
+    Builder.CreateUnreachable();
+    SWFTAdded += 3;
+  }
+  return fail;
+}
+
+// Inline form of a check: split the block before insertPt and only fall
+// through to it if the compare holds. The branch is weighted so that the
+// failure edge is predicted never taken.
+static BranchInst *InsertInlineCheck(Instruction *insertPt, Value *ok) {
+  BasicBlock *bscblk = insertPt->getParent();
+  BasicBlock *fail = GetFailBlock(bscblk->getParent());
+  BasicBlock *cont = bscblk->splitBasicBlock(insertPt, "ft.cont");
+  bscblk->getTerminator()->eraseFromParent();
+
+  BranchInst *br = BranchInst::Create(cont, fail, ok, bscblk);
+  br->setMetadata(LLVMContext::MD_prof, MDBuilder(br->getContext()).createBranchWeights(2000, 1));
+  SWFTAdded++;
+
+  cast<PHINode>(&fail->front())->addIncoming(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()), my_UID), bscblk);
+  my_UID++;
+  return br;
+}
+
+// insert ICMPEQ, ZEXT and ASSERT before insertPt comparing orig with its clone
+static void InsertCheck(Instruction *insertPt, Value *orig, Value *clone) {
+  IRBuilder<> Builder(insertPt);
+  Value* ret = Builder.CreateICmpEQ(orig, clone);
+  SWFTAdded++;
+  // a landing pad has to stay first in its block, so it cannot be split off
+  if (InlineChecks && !insertPt->isEHPad()) {
+    InsertInlineCheck(insertPt, ret);
+    return;
+  }
+  Value* zextRetVal = Builder.CreateZExt(ret, IntegerType::getInt32Ty(getGlobalContext()));
+  SWFTAdded++;
+  std::vector<Value*> args_for_assert;
+  args_for_assert.push_back(zextRetVal);
+  args_for_assert.push_back(Builder.getInt32(my_UID));
+  Builder.CreateCall(AssertFT, args_for_assert);
+  SWFTAdded++;
+  //Global Variable UID is used to assihn it for ZEXT
+  my_UID++;
+}
+
+/*  -tmr: where a value would be checked, the three copies vote instead
+      integers:  (a & b) | (a & c) | (b & c)
+      pointers:  a == b ? a : c
+    which is the value at least two of them agree on, without a branch.
+    The caller uses the voted value in place of the original from there
+    on, so a corrupted copy is outvoted and execution goes on. The vote is
+    marked with !ft.vote for the coverage estimate. With -tmr-votes,
+      counts[k] += (a != b) | (a != c)
+    counts the votes that outvoted a copy.
+*/
+GlobalVariable *tmrVoteCounts = nullptr;  // placeholder until the number of votes is known
+std::vector<std::string> tmrVoteLabels;
+
+static Value *InsertVote(Instruction *insertPt, Instruction *orig) {
+  IRBuilder<> Builder(insertPt);
+  Value *a = orig, *b = cloneMap[orig], *c = cloneMap2[orig];
+  std::vector<Value*> vote;
+  if (orig->getType()->isPointerTy()) {
+    vote.push_back(Builder.CreateICmpEQ(a, b));
+    vote.push_back(Builder.CreateSelect(vote.back(), a, c, "ft.vote"));
+  } else {
+    vote.push_back(Builder.CreateAnd(a, b));
+    vote.push_back(Builder.CreateAnd(a, c));
+    vote.push_back(Builder.CreateAnd(b, c));
+    vote.push_back(Builder.CreateOr(vote[0], vote[1]));
+    vote.push_back(Builder.CreateOr(vote[3], vote[2], "ft.vote"));
+  }
+  MDNode *tag = MDNode::get(insertPt->getContext(), {});
+  for (Value *v : vote)
+    cast<Instruction>(v)->setMetadata("ft.vote", tag);
+  SWFTAdded += vote.size();
+  SWFTVotes++;
+
+  if (tmrVoteCounts) {
+    Type *i64 = Builder.getInt64Ty();
+    Value *outvoted = Builder.CreateOr(Builder.CreateICmpNE(a, b), Builder.CreateICmpNE(a, c));
+    Value *ptr = Builder.CreateConstInBoundsGEP1_64(i64, tmrVoteCounts, tmrVoteLabels.size());
+    Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(i64, ptr), Builder.CreateZExt(outvoted, i64)), ptr);
+    tmrVoteLabels.push_back((insertPt->getFunction()->getName() + " " + Twine(my_UID)).str());
+    SWFTAdded += 7;
+  }
+  my_UID++;
+  return vote.back();
+}
+
+// a check after every cloned instruction, except for the ones in except
+static void InsertEveryInstChecks(Function *passed_func, const DenseSet<Instruction*> *except) {
+  // in program order, the checks split blocks
+  std::vector<Instruction*> origs;
+  for (BasicBlock &bscblk : *passed_func)
+    for (Instruction &inst : bscblk)
+      if (cloneMap.count(&inst) && isCheckable(&inst) && !(except && except->count(&inst)))
+        origs.push_back(&inst);
+
+  for (Instruction *orign_inst : origs) {
+    //if it is a PHI instruction, check at the first non-phi instruction
+    Instruction *insertPt = (orign_inst->getOpcode() == Instruction::PHI) ? AfterPhis(orign_inst->getParent()) : orign_inst->getNextNode();
+    if (Tmr) {
+      // all later uses of the original take the voted value
+      std::vector<Use*> uses;
+      for (Use &U : orign_inst->uses())
+        uses.push_back(&U);
+      Value *voted = InsertVote(insertPt, orign_inst);
+      for (Use *U : uses)
+        U->set(voted);
+      continue;
+    }
+    InsertCheck(insertPt, orign_inst, cloneMap[orign_inst]);
+  }
+}
+
+/*  SWIFT-style checking: data flowing between instructions stays duplicated
+    but unchecked, and originals are compared with their clones only where
+    they leave the duplicated code:
+      store    value and address
+      branch   condition (conditional br, switch, indirectbr)
+      call     arguments
+      ret      return value
+*/
+static bool isSyncPoint(Instruction &inst) {
+  return isa<StoreInst>(inst) || isa<ReturnInst>(inst) || isa<SwitchInst>(inst) || isa<IndirectBrInst>(inst) ||
+         (isa<BranchInst>(inst) && cast<BranchInst>(inst).isConditional()) ||
+         (isa<CallBase>(inst) && cast<CallBase>(inst).getCalledFunction() != AssertFT.getCallee() &&
+          (!AssertFail || cast<CallBase>(inst).getCalledFunction() != AssertFail.getCallee()));
+}
+
+// with only, just the operands in that set are checked. The instructions
+// -protect-budget left unduplicated (skip) are where their operands leave
+// the duplicated code too; a phi among them has its incoming values checked
+// at the end of the block they come from.
+static void InsertSyncPointChecks(Function *passed_func, const DenseSet<Instruction*> *only,
+                                  const DenseSet<Instruction*> &skip) {
+  std::vector<Instruction*> syncPoints;
+  for (BasicBlock &bscblk : *passed_func) {
+    for (Instruction &inst : bscblk) {
+      if (isSyncPoint(inst) || skip.count(&inst))
+        syncPoints.push_back(&inst);
+    }
+  }
+
+  auto needsCheck = [&](Value *op) {
+    Instruction *inst_op = dyn_cast<Instruction>(op);
+    return inst_op && cloneMap.count(inst_op) && isCheckable(inst_op) && !(only && !only->count(inst_op));
+  };
+
+  for (Instruction *sync : syncPoints) {
+    if (PHINode *phi = dyn_cast<PHINode>(sync)) {
+      // a block can come in more than once, with the same value each time
+      std::map<BasicBlock*, Value*> voted;
+      for (unsigned i = 0; i < phi->getNumIncomingValues(); i++) {
+        if (!needsCheck(phi->getIncomingValue(i)))
+          continue;
+        Instruction *inst_op = cast<Instruction>(phi->getIncomingValue(i));
+        // looked up each time, an inline check splits the block it goes in
+        BasicBlock *pred = phi->getIncomingBlock(i);
+        auto v = voted.find(pred);
+        if (v != voted.end())
+          phi->setIncomingValue(i, v->second);
+        else if (Tmr)
+          phi->setIncomingValue(i, voted[pred] = InsertVote(pred->getTerminator(), inst_op));
+        else
+          InsertCheck(pred->getTerminator(), voted[pred] = inst_op, cloneMap[inst_op]);
+      }
+      continue;
+    }
+    std::set<Value*> checked;
+    // for calls this includes the callee, so indirect call targets are checked too
+    for (Value *op : sync->operands()) {
+      if (!needsCheck(op) || !checked.insert(op).second)
+        continue;
+      Instruction *inst_op = cast<Instruction>(op);
+      if (Tmr)
+        sync->replaceUsesOfWith(inst_op, InsertVote(sync, inst_op));
+      else
+        InsertCheck(sync, inst_op, cloneMap[inst_op]);
+    }
+  }
+}
+
+// orig ^ clone widened to i64: zero exactly when the two agree
+static Value *MismatchBits(IRBuilder<> &Builder, Value *orig, Value *clone) {
+  Type *i64 = Builder.getInt64Ty();
+  if (orig->getType()->isPointerTy()) {
+    orig = Builder.CreatePtrToInt(orig, i64);
+    clone = Builder.CreatePtrToInt(clone, i64);
+    SWFTAdded += 2;
+  }
+  Value *diff = Builder.CreateXor(orig, clone);
+  SWFTAdded++;
+  if (diff->getType() != i64) {
+    diff = Builder.CreateZExt(diff, i64);
+    SWFTAdded++;
+  }
+  return diff;
+}
+
+/*  Signature-accumulated checking: within a block, the mismatches of all
+    original/clone pairs are ORed into one accumulator, which is compared
+    with zero once, right before the next instruction with side effects
+    (store, call, ...) or the terminator. OR never cancels, so the
+    accumulator is non-zero whenever any pair differs and every fault the
+    per-instruction checks detect is still detected, only later within
+    the block and before it can escape.
+*/
+// the instructions of a block, taken before any check splits it
+static std::vector<Instruction*> BlockSnapshot(BasicBlock *bscblk) {
+  std::vector<Instruction*> insts;
+  for (Instruction &inst : *bscblk)
+    insts.push_back(&inst);
+  return insts;
+}
+
+static void InsertBlockSignatureCheck(const std::vector<Instruction*> &insts) {
+  std::vector<Instruction*> pending;
+  for (Instruction *inst : insts) {
+    if (!pending.empty() && (inst->mayHaveSideEffects() || inst->isTerminator())) {
+      IRBuilder<> Builder(inst);
+      Value *acc = nullptr;
+      for (Instruction *orig : pending) {
+        Value *diff = MismatchBits(Builder, orig, cloneMap[orig]);
+        if (acc) {
+          acc = Builder.CreateOr(acc, diff);
+          SWFTAdded++;
+        } else {
+          acc = diff;
+        }
+      }
+      InsertCheck(inst, acc, Builder.getInt64(0));
+      pending.clear();
+    }
+
+    if (cloneMap.count(inst) == 0 || !isCheckable(inst))
+      continue;
+    if (inst->getType()->isIntegerTy() && inst->getType()->getIntegerBitWidth() > 64) {
+      Instruction *insertPt = isa<PHINode>(inst) ? AfterPhis(inst->getParent()) : inst->getNextNode();
+      InsertCheck(insertPt, inst, cloneMap[inst]);
+    } else {
+      pending.push_back(inst);
+    }
+  }
+}
+
+static void InsertBlockSignatureChecks(Function *passed_func) {
+  std::vector<std::vector<Instruction*>> blocks;
+  for (BasicBlock &bscblk : *passed_func)
+    blocks.push_back(BlockSnapshot(&bscblk));
+
+  for (auto &insts : blocks)
+    InsertBlockSignatureCheck(insts);
+}
+
+/*  Loop-accumulated checking: the block accumulator is carried across the
+    blocks and iterations of each outermost loop instead of being checked
+    at every block end:
+      preheader:  acc = 0
+      loop block: acc.in = phi [acc.out of each pred]
+                  acc |= orig ^ clone      after every cloned value
+      exit block: acc.exit = phi [...], checked once
+    Inside the loop the accumulator is only checked, and then restarted
+    from zero, in front of side effects that can let a wrong value escape:
+    stores that may not go to a local alloca, and calls. Blocks outside
+    loops, and loops without a preheader or dedicated exits, get the
+    per-block checks of -swft-checks=block.
+*/
+static bool isEscapingSideEffect(Instruction *inst) {
+  if (!inst->mayHaveSideEffects())
+    return false;
+  if (StoreInst *st = dyn_cast<StoreInst>(inst))
+    return st->isVolatile() || !isa<AllocaInst>(getUnderlyingObject(st->getPointerOperand()));
+  if (CallBase *call = dyn_cast<CallBase>(inst)) {
+    Function *callee = call->getCalledFunction();
+    return !callee || (callee != AssertFT.getCallee() && callee != AssertCFG.getCallee() &&
+                       (!AssertFail || callee != AssertFail.getCallee()));
+  }
+  return true;
+}
+
+// blocks that only report a failure and stop
+static bool isFailureBlock(BasicBlock *bscblk) {
+  CallInst *call = dyn_cast<CallInst>(bscblk->getFirstNonPHI());
+  Function *callee = call ? call->getCalledFunction() : nullptr;
+  return isa<UnreachableInst>(bscblk->getTerminator()) && AssertFail && callee == AssertFail.getCallee();
+}
+
+// every exit of L is only entered from L, except for the failure block the
+// inline checks of the function share
+static bool hasDedicatedExits(Loop *L) {
+  SmallVector<BasicBlock*, 4> exits;
+  L->getUniqueExitBlocks(exits);
+  for (BasicBlock *exit : exits)
+    if (!isFailureBlock(exit))
+      for (BasicBlock *pred : predecessors(exit))
+        if (!L->contains(pred))
+          return false;
+  return true;
+}
+
+static void InsertLoopAccumulatedCheck(Loop *L) {
+  Type *i64 = Type::getInt64Ty(L->getHeader()->getContext());
+  Constant *zero = ConstantInt::get(i64, 0);
+  std::map<BasicBlock*, PHINode*> accIn;
+  std::map<BasicBlock*, Value*> accOut;
+  std::vector<std::pair<Instruction*, Value*>> flushes;
+  std::vector<std::pair<Instruction*, Instruction*>> wide;
+
+  for (BasicBlock *bscblk : L->blocks()) {
+    accIn[bscblk] = PHINode::Create(i64, 0, "ft.acc", &bscblk->front());
+    SWFTAdded++;
+  }
+
+  for (BasicBlock *bscblk : L->blocks()) {
+    std::vector<Instruction*> insts;
+    for (Instruction &inst : *bscblk)
+      insts.push_back(&inst);
+
+    // computed once so the phis' updates stay in order
+    Instruction *phiPt = AfterPhis(bscblk);
+    Value *acc = accIn[bscblk];
+    for (Instruction *inst : insts) {
+      if (isEscapingSideEffect(inst) && acc != zero) {
+        flushes.push_back({inst, acc});
+        acc = zero;
+      }
+      if (cloneMap.count(inst) == 0 || !isCheckable(inst))
+        continue;
+      if (inst->getType()->isIntegerTy() && inst->getType()->getIntegerBitWidth() > 64) {
+        wide.push_back({isa<PHINode>(inst) ? phiPt : inst->getNextNode(), inst});
+        continue;
+      }
+      IRBuilder<> Builder(isa<PHINode>(inst) ? phiPt : inst->getNextNode());
+      Value *diff = MismatchBits(Builder, inst, cloneMap[inst]);
+      if (acc == zero) {
+        acc = diff;
+      } else {
+        acc = Builder.CreateOr(acc, diff, "ft.acc");
+        SWFTAdded++;
+      }
+    }
+    accOut[bscblk] = acc;
+  }
+
+  for (BasicBlock *bscblk : L->blocks())
+    for (BasicBlock *pred : predecessors(bscblk))
+      accIn[bscblk]->addIncoming(L->contains(pred) ? accOut[pred] : zero, pred);
+
+  SmallVector<BasicBlock*, 4> exits;
+  L->getUniqueExitBlocks(exits);
+  for (BasicBlock *exit : exits) {
+    if (isFailureBlock(exit))
+      continue;
+    PHINode *phi = PHINode::Create(i64, 0, "ft.acc.exit", &exit->front());
+    for (BasicBlock *pred : predecessors(exit))
+      phi->addIncoming(accOut[pred], pred);
+    SWFTAdded++;
+    flushes.push_back({AfterPhis(exit), phi});
+  }
+
+  // only now, the inline checks split blocks
+  for (auto &f : flushes)
+    InsertCheck(f.first, f.second, zero);
+  for (auto &w : wide)
+    InsertCheck(w.first, w.second, cloneMap[w.second]);
+}
+
+static void InsertLoopAccumulatedChecks(Function *passed_func) {
+  DominatorTree DT(*passed_func);
+  LoopInfo LI(DT);
+
+  std::set<BasicBlock*> inLoop;
+  std::vector<Loop*> loops;
+  for (Loop *L : LI) {
+    if (!L->getLoopPreheader() || !hasDedicatedExits(L))
+      continue;
+    loops.push_back(L);
+    inLoop.insert(L->block_begin(), L->block_end());
+  }
+
+  // the flushes at the loop exits split exit blocks, so the rest of
+  // those blocks is found through the snapshots
+  std::vector<std::vector<Instruction*>> blocks;
+  for (BasicBlock &bscblk : *passed_func)
+    if (inLoop.count(&bscblk) == 0)
+      blocks.push_back(BlockSnapshot(&bscblk));
+
+  for (Loop *L : loops)
+    InsertLoopAccumulatedCheck(L);
+  for (auto &insts : blocks)
+    InsertBlockSignatureCheck(insts);
+}
+
+/*  Control-flow checking by signatures (CFCSS):
+      every block b gets a compile-time signature s_b
+      the runtime signature G is an SSA value: G_entry = s_entry, and in
+      every other block G_b = phi [G_p ^ (s_p ^ s_b), p] over its preds p,
+      so G_b == s_b whenever control arrived over a legal edge
+    The xor for an edge is computed in the predecessor. For a conditional
+    branch it selects on the clone of the condition, so a fault that makes
+    the original condition disagree with its clone sends control to a block
+    whose signature does not match.
+    G is compared with s_b only in the blocks picked by -cfg-checks; the
+    xor chain carries a wrong signature forward until the next check.
+*/
+uint32_t my_CfgID = 1;
+
+static void VerifyCfg(Function *passed_func, const std::vector<BasicBlock*> &loopHeaders) {
+  // funclet pads cannot have instructions in front of their terminator
+  for (BasicBlock &bscblk : *passed_func)
+    if (bscblk.isEHPad() && !bscblk.isLandingPad())
+      return;
+
+  LLVMContext &C = passed_func->getContext();
+  Type *i32 = Type::getInt32Ty(C);
+
+  std::vector<BasicBlock*> blocks;
+  std::unordered_map<BasicBlock*, uint32_t> sig;
+  std::unordered_map<BasicBlock*, Value*> G;
+  std::set<Instruction*> added;
+  for (BasicBlock &bscblk : *passed_func) {
+    blocks.push_back(&bscblk);
+    // odd multiplier keeps the signatures distinct and spreads their bits
+    sig[&bscblk] = my_CfgID++ * 2654435761u;
+  }
+
+  BasicBlock *entry = &passed_func->getEntryBlock();
+  G[entry] = ConstantInt::get(i32, sig[entry]);
+  if (ReOpt)
+    G[entry] = OpaqueCopy(G[entry], &*entry->getFirstInsertionPt());
+  for (BasicBlock *bscblk : blocks) {
+    if (bscblk == entry)
+      continue;
+    PHINode *phi = PHINode::Create(i32, 0, "cfg.sig", &bscblk->front());
+    G[bscblk] = phi;
+    added.insert(phi);
+  }
+
+  // signature updates along the outgoing edges of each block
+  for (BasicBlock *bscblk : blocks) {
+    Instruction *term = bscblk->getTerminator();
+    IRBuilder<> Builder(term);
+    BranchInst *br = dyn_cast<BranchInst>(term);
+    if (br && br->isConditional() && br->getSuccessor(0) != br->getSuccessor(1)) {
+      Value *cond = br->getCondition();
+      Instruction *condInst = dyn_cast<Instruction>(cond);
+      if (condInst && cloneMap.count(condInst))
+        cond = cloneMap[condInst];
+      Value *d = Builder.CreateSelect(cond,
+                                      Builder.getInt32(sig[bscblk] ^ sig[br->getSuccessor(0)]),
+                                      Builder.getInt32(sig[bscblk] ^ sig[br->getSuccessor(1)]));
+      Value *next = Builder.CreateXor(G[bscblk], d, "cfg.next");
+      added.insert(cast<Instruction>(d));
+      added.insert(cast<Instruction>(next));
+      cast<PHINode>(G[br->getSuccessor(0)])->addIncoming(next, bscblk);
+      cast<PHINode>(G[br->getSuccessor(1)])->addIncoming(next, bscblk);
+      continue;
+    }
+    std::map<BasicBlock*, Value*> next;
+    for (unsigned i = 0; i < term->getNumSuccessors(); i++) {
+      BasicBlock *succ = term->getSuccessor(i);
+      Value *&n = next[succ];
+      if (n == nullptr) {
+        n = Builder.CreateXor(G[bscblk], Builder.getInt32(sig[bscblk] ^ sig[succ]), "cfg.next");
+        if (Instruction *I = dyn_cast<Instruction>(n))
+          added.insert(I);
+      }
+      // one incoming value per edge, also for duplicate switch cases
+      cast<PHINode>(G[succ])->addIncoming(n, bscblk);
+    }
+  }
+
+  std::vector<BasicBlock*> checked;
+  if (CfgChecks == CfgAll) {
+    checked = blocks;
+  } else {
+    for (BasicBlock *bscblk : blocks)
+      if (succ_empty(bscblk) && !isa<UnreachableInst>(bscblk->getTerminator()))
+        checked.push_back(bscblk);
+    if (CfgChecks == CfgLoops)
+      checked.insert(checked.end(), loopHeaders.begin(), loopHeaders.end());
+  }
+
+  //   call @assert_cfg_ft(i32 zext(G_b == s_b), i32 <block id>, i32 G_b)
+  // or with -inline-checks a branch to the function's shared failure block,
+  // marked !ft.cfg to tell it from the data checks
+  std::vector<Instruction*> live;
+  for (BasicBlock *bscblk : checked) {
+    if (Instruction *I = dyn_cast<Instruction>(G[bscblk]))
+      live.push_back(I);
+    Instruction *insertPt = AfterPhis(bscblk);
+    IRBuilder<> Builder(insertPt);
+    Value *ok = Builder.CreateICmpEQ(G[bscblk], Builder.getInt32(sig[bscblk]));
+    SWFTAdded++;
+    if (InlineChecks) {
+      InsertInlineCheck(insertPt, ok)->setMetadata("ft.cfg", MDNode::get(C, {}));
+    } else {
+      Value *args[] = {Builder.CreateZExt(ok, i32), Builder.getInt32(my_UID++), G[bscblk]};
+      Builder.CreateCall(AssertCFG, args);
+      SWFTAdded += 2;
+    }
+  }
+
+  // drop signature updates that no check depends on
+  std::set<Instruction*> keep;
+  while (!live.empty()) {
+    Instruction *I = live.back();
+    live.pop_back();
+    if (added.count(I) == 0 || !keep.insert(I).second)
+      continue;
+    for (Value *op : I->operands())
+      if (Instruction *opInst = dyn_cast<Instruction>(op))
+        live.push_back(opInst);
+  }
+  for (Instruction *I : added)
+    if (keep.count(I) == 0)
+      I->dropAllReferences();
+  for (Instruction *I : added)
+    if (keep.count(I) == 0)
+      I->eraseFromParent();
+  SWFTAdded += keep.size();
+}
+
+/*  Redundant-check elimination, run on a function once its data checks
+    are in. A check is the compare of an original with its clone plus
+    either the call to assert_ft or the branch to the failure block. It
+    is removed when
+      - a check of the same two values dominates it: SSA values do not
+        change after they were verified
+      - the checked value X has one user U besides its checks, U is
+        injective in X (add, sub, xor with an operand not computed from
+        X, zext, sext, bitcast), U's clone uses X's clone in the same place, and U is
+        checked in its own block: a fault in X always shows up in U, and
+        can only escape through U
+    Either way every single fault the removed check caught is still
+    caught, and the same instructions stay covered.
+*/
+struct DataCheck {
+  Instruction *term;  // call to assert_ft, or the branch to ft.fail
+  ICmpInst *cmp;
+};
+
+// whether V is computed from X, looking at most MaxDepends values back.
+// The walk stops at U: what V gets from U (around a loop) was made from an
+// earlier X, which was verified through U back then.
+static const unsigned MaxDepends = 64;
+
+static bool dependsOn(Value *V, Value *X, Instruction *U) {
+  std::vector<Value*> worklist = {V};
+  SmallPtrSet<Value*, 16> seen = {U};
+  while (!worklist.empty()) {
+    Value *v = worklist.back();
+    worklist.pop_back();
+    if (v == X || seen.size() > MaxDepends)
+      return true;
+    Instruction *inst = dyn_cast<Instruction>(v);
+    if (!inst || !seen.insert(inst).second)
+      continue;
+    for (Value *op : inst->operands())
+      worklist.push_back(op);
+  }
+  return false;
+}
+
+// U's result determines X: X is an operand of U, and for the binary ones
+// the other operand does not depend on X
+static bool isInjectiveIn(Instruction *U, Value *X) {
+  switch (U->getOpcode()) {
+  case Instruction::Add: case Instruction::Sub: case Instruction::Xor:
+    if (U->getOperand(0) == X)
+      return !dependsOn(U->getOperand(1), X, U);
+    if (U->getOperand(1) == X)
+      return !dependsOn(U->getOperand(0), X, U);
+    return false;
+  case Instruction::ZExt: case Instruction::SExt: case Instruction::BitCast:
+    return U->getOperand(0) == X;
+  default:
+    return false;
+  }
+}
+
+static void RemoveCheck(DataCheck &C) {
+  if (CallInst *call = dyn_cast<CallInst>(C.term)) {
+    Instruction *zext = cast<Instruction>(call->getArgOperand(0));
+    call->eraseFromParent();
+    SWFTAdded--;
+    if (zext->use_empty()) {
+      zext->eraseFromParent();
+      SWFTAdded--;
+    }
+  } else {
+    BasicBlock *bscblk = C.term->getParent();
+    BasicBlock *cont = C.term->getSuccessor(0);
+    C.term->getSuccessor(1)->removePredecessor(bscblk, true);
+    BranchInst::Create(cont, C.term);
+    C.term->eraseFromParent();
+    SWFTAdded--;
+    MergeBlockIntoPredecessor(cont);
+  }
+  if (C.cmp->use_empty()) {
+    C.cmp->eraseFromParent();
+    SWFTAdded--;
+  }
+  SWFTRedundant++;
+}
+
+// the data checks of a function, in program order
+static void CollectDataChecks(Function *passed_func, std::vector<DataCheck> &checks) {
+  BasicBlock *fail = failBlocks.count(passed_func) ? failBlocks[passed_func] : nullptr;
+  for (BasicBlock &bscblk : *passed_func) {
+    for (Instruction &inst : bscblk) {
+      ICmpInst *cmp = nullptr;
+      if (CallInst *call = dyn_cast<CallInst>(&inst)) {
+        ZExtInst *zext = call->getCalledFunction() == AssertFT.getCallee() ?
+          dyn_cast<ZExtInst>(call->getArgOperand(0)) : nullptr;
+        cmp = zext ? dyn_cast<ICmpInst>(zext->getOperand(0)) : nullptr;
+      } else if (BranchInst *br = dyn_cast<BranchInst>(&inst)) {
+        if (fail && br->isConditional() && br->getSuccessor(1) == fail && !br->getMetadata("ft.cfg"))
+          cmp = dyn_cast<ICmpInst>(br->getCondition());
+      }
+      if (cmp && cmp->getPredicate() == ICmpInst::ICMP_EQ)
+        checks.push_back({&inst, cmp});
+    }
+  }
+}
+
+static void EliminateRedundantChecks(Function *passed_func) {
+  BasicBlock *fail = failBlocks.count(passed_func) ? failBlocks[passed_func] : nullptr;
+  std::vector<DataCheck> checks;
+  CollectDataChecks(passed_func, checks);
+  std::set<Instruction*> checkCmps;
+  for (DataCheck &C : checks)
+    checkCmps.insert(C.cmp);
+
+  DominatorTree DT(*passed_func);
+  std::vector<bool> redundant(checks.size(), false);
+
+  // the same two values checked again
+  std::map<std::pair<Value*, Value*>, std::vector<unsigned>> byPair;
+  for (unsigned i = 0; i < checks.size(); i++)
+    byPair[{checks[i].cmp->getOperand(0), checks[i].cmp->getOperand(1)}].push_back(i);
+  for (auto &p : byPair)
+    for (unsigned i : p.second)
+      for (unsigned j : p.second)
+        if (i != j && !redundant[j] && DT.dominates(checks[j].term, checks[i].term)) {
+          redundant[i] = true;
+          break;
+        }
+
+  // values only feeding a checked injective user
+  std::map<Value*, std::vector<unsigned>> byValue;
+  for (unsigned i = 0; i < checks.size(); i++)
+    if (!redundant[i])
+      byValue[checks[i].cmp->getOperand(0)].push_back(i);
+  for (unsigned i = 0; i < checks.size(); i++) {
+    if (redundant[i])
+      continue;
+    Value *X = checks[i].cmp->getOperand(0);
+    Value *Xc = checks[i].cmp->getOperand(1);
+    Instruction *U = nullptr;
+    unsigned nUsers = 0;
+    for (User *user : X->users())
+      if (checkCmps.count(cast<Instruction>(user)) == 0) {
+        U = cast<Instruction>(user);
+        nUsers++;
+      }
+    if (nUsers != 1 || isa<PHINode>(U) || !isInjectiveIn(U, X) || cloneMap.count(U) == 0)
+      continue;
+    Instruction *Uc = cloneMap[U];
+    bool sameShape = true;
+    for (unsigned op = 0; op < U->getNumOperands(); op++)
+      sameShape &= (U->getOperand(op) == X) == (Uc->getOperand(op) == Xc);
+    if (!sameShape)
+      continue;
+    for (unsigned j : byValue[U])
+      if (checks[j].term->getParent() == U->getParent()) {
+        redundant[i] = true;
+        break;
+      }
+  }
+
+  for (unsigned i = 0; i < checks.size(); i++)
+    if (redundant[i])
+      RemoveCheck(checks[i]);
+
+  if (fail && pred_empty(fail)) {
+    fail->dropAllReferences();
+    fail->eraseFromParent();
+    failBlocks.erase(passed_func);
+    SWFTAdded -= 3;
+  }
+}
+
+/*  Optimization barriers for -reopt. Running O2 on the protected module
+    would let GVN and InstCombine fold every clone back into its original
+    and every check into "true". An empty inline asm with a tied register
+      %x.b = call i32 asm "", "=r,0"(i32 %x)
+    is an identity the optimizer cannot see through and that costs nothing
+    but a register at codegen. It goes on
+      - an operand of the clone roots, clones none of whose operands is a
+        clone, so the root itself is still computed twice
+      - the cloned phis, which could otherwise close a cycle equivalent
+        to the original one
+    Every other clone then differs from its original through its operands.
+      - one operand of every check, so compares are not simplified into
+        compares of other values
+      - the initial control-flow signature, so the signature chain is not
+        folded to constants
+*/
+// copies of one value that must stay apart, like the two -tmr clones, get
+// different numbers of blanks as asm text, or CSE merges the barriers
+static Value *OpaqueCopy(Value *v, Instruction *insertPt, unsigned apart) {
+  IRBuilder<> Builder(insertPt);
+  Type *T = v->getType();
+  if (T->isIntegerTy(1))
+    return Builder.CreateTrunc(OpaqueCopy(Builder.CreateZExt(v, Builder.getInt8Ty()), insertPt, apart), T);
+  if (T->isHalfTy() || T->isFloatTy() || T->isDoubleTy()) {
+    Type *bits = Builder.getIntNTy(T->getPrimitiveSizeInBits());
+    return Builder.CreateBitCast(OpaqueCopy(Builder.CreateBitCast(v, bits), insertPt, apart), T);
+  }
+  // no general purpose register holds it
+  if (!T->isPointerTy() && !(T->isIntegerTy() && T->getIntegerBitWidth() <= 64))
+    return v;
+  InlineAsm *barrier = InlineAsm::get(FunctionType::get(T, {T}, false), std::string(apart, ' '), "=r,0", false);
+  CallInst *copy = Builder.CreateCall(barrier, {v});
+  // not a side effect: block checks are not flushed in front of it
+  copy->setDoesNotAccessMemory();
+  copy->setDoesNotThrow();
+  copy->addFnAttr(Attribute::WillReturn);
+  return copy;
+}
+
+static void HideCloneRoots(Function *passed_func, DenseMap<Instruction*, Instruction*> &map, unsigned apart) {
+  std::set<Instruction*> clones, cloneLanes;
+  for (auto &c : map)
+    clones.insert(c.second);
+  // lanes come from a vector whose lanes were made distinct when packed
+  for (Instruction *origLane : laneExtracts)
+    cloneLanes.insert(cloneMap[origLane]);
+
+  for (BasicBlock &bscblk : *passed_func) {
+    for (Instruction &inst : bscblk) {
+      auto c = map.find(&inst);
+      if (c == map.end() || cloneLanes.count(c->second))
+        continue;
+      Instruction *clone = c->second;
+      bool root = true;
+      for (Value *op : clone->operands())
+        root &= !(isa<Instruction>(op) && clones.count(cast<Instruction>(op)));
+
+      // separate allocas are never merged, and their size has to stay constant
+      if (root && !isa<PHINode>(clone) && !isa<AllocaInst>(clone)) {
+        for (unsigned op = 0; op < clone->getNumOperands(); op++) {
+          Value *hidden = OpaqueCopy(clone->getOperand(op), clone, apart);
+          if (hidden != clone->getOperand(op)) {
+            clone->setOperand(op, hidden);
+            break;
           }
+        }
+      }
+      if (!isa<PHINode>(clone))
+        continue;
+
+      std::vector<Use*> uses;
+      for (Use &U : clone->uses())
+        uses.push_back(&U);
+      Value *hidden = OpaqueCopy(clone, &*bscblk.getFirstInsertionPt(), apart);
+      if (hidden == clone)
+        continue;
+      for (Use *U : uses)
+        U->set(hidden);
+      c->second = cast<Instruction>(hidden);
+      clones.insert(c->second);
+    }
+  }
+}
+
+static void HideCheckOperands(Function *passed_func) {
+  std::vector<DataCheck> checks;
+  CollectDataChecks(passed_func, checks);
+  // one opaque side is enough to keep the compare as it is
+  for (DataCheck &C : checks) {
+    unsigned op = isa<Constant>(C.cmp->getOperand(1)) ? 0 : 1;
+    C.cmp->setOperand(op, OpaqueCopy(C.cmp->getOperand(op), C.cmp));
+  }
+}
 
+/*  Block profiles for -profile-gen and -profile-use. A block is named by
+    its function and its position in it after the first O2, which is the
+    same in the -profile-gen build and in a later -profile-use run on the
+    same input:
+      @p3.block.counts = [N x i64]    one counter per block
+      counts[i] += 1                  at the top of each block
+    When the program exits, "<function> <block> <count>" is appended to the
+    file for every block that ran, so the counts of several runs add up.
+*/
+static bool isProfiled(Function &F) {
+  return !F.isDeclaration() && F.hasName() && &F != AssertFT.getCallee() && &F != AssertCFG.getCallee();
+}
+
+static void InstrumentBlockCounts(Module *M) {
+  Type *i64 = Type::getInt64Ty(M->getContext());
+  std::vector<BasicBlock*> blocks;
+  std::vector<std::string> labels;
+  for (Function &F : *M) {
+    if (!isProfiled(F))
+      continue;
+    unsigned n = 0;
+    for (BasicBlock &bscblk : F) {
+      blocks.push_back(&bscblk);
+      labels.push_back((F.getName() + " " + Twine(n++)).str());
+    }
+  }
+
+  ArrayType *countsTy = ArrayType::get(i64, blocks.size());
+  GlobalVariable *counts = new GlobalVariable(*M, countsTy, false, GlobalValue::InternalLinkage,
+                                              ConstantAggregateZero::get(countsTy), "p3.block.counts");
+  for (unsigned i = 0; i < blocks.size(); i++) {
+    BasicBlock::iterator insertPt = blocks[i]->getFirstInsertionPt();
+    // a catchswitch block has no room for the increment
+    if (insertPt == blocks[i]->end())
+      continue;
+    IRBuilder<> Builder(&*insertPt);
+    Value *ptr = Builder.CreateConstInBoundsGEP2_64(countsTy, counts, 0, i);
+    Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(i64, ptr), Builder.getInt64(1)), ptr);
+  }
+  BuildCounterDump(M, counts, labels, ProfileGen, "p3.dump.block.counts");
+}
+
+// the counts of a -profile-gen file, summed over the runs in it
+static std::map<std::string, std::map<unsigned, uint64_t>> ReadBlockProfile(const std::string &path) {
+  std::map<std::string, std::map<unsigned, uint64_t>> profile;
+  std::ifstream in(path);
+  if (!in) {
+    errs() << "p3: cannot read profile " << path << "\n";
+    exit(1);
+  }
+  std::string fn;
+  unsigned block;
+  uint64_t count;
+  while (in >> fn >> block >> count)
+    profile[fn][block] += count;
+  return profile;
+}
+
+// Instructions F runs with the given block counts. Blocks split off since
+// the counts were taken run as often as their only predecessor; failure
+// blocks, which end in unreachable, are taken to never run.
+static uint64_t DynamicInstructions(Function *F, DenseMap<BasicBlock*, uint64_t> counts) {
+  uint64_t total = 0;
+  // splitBasicBlock puts the new block right after the old one
+  for (BasicBlock &bscblk : *F) {
+    auto c = counts.find(&bscblk);
+    if (c == counts.end()) {
+      BasicBlock *pred = bscblk.getUniquePredecessor();
+      uint64_t n = 0;
+      if (pred && counts.count(pred) && !isa<UnreachableInst>(bscblk.getTerminator()))
+        n = counts[pred];
+      c = counts.insert({&bscblk, n}).first;
+    }
+    total += c->second * bscblk.size();
+  }
+  return total;
+}
+
+/*  What SoftwareFaultTolerance needs to know about a function before it
+    changes it. Working this out only reads the IR, so it is done for all
+    functions up front, on a thread pool with -j. The transformation itself
+    stays serial: the LLVMContext (uniqued constants, use lists of globals
+    such as assert_ft) is shared by all functions and is not thread-safe.
+*/
+struct FunctionPlan {
+  Function *F;
+  uint32_t nUIDs = 0;     // upper bound on the checks F can get
+  uint32_t firstUID = 0;  // F's checks are numbered from here on
+  std::vector<BasicBlock*> loopHeaders;
+  // -protect-budget: vulnerability of each replicable instruction, in
+  // program order, and the ones that lost out to other instructions
+  std::vector<std::pair<Instruction*, unsigned>> ranks;
+  DenseSet<Instruction*> skip;
+  // -profile-use: how often each block ran, and the ones that are hot
+  DenseMap<BasicBlock*, uint64_t> blockCounts;
+  DenseSet<BasicBlock*> hotBlocks;
+};
+
+/*  Static vulnerability of a value: how many places where a wrong value
+    becomes visible it can reach through def-use chains. Those sinks are
+    the operands of stores, calls, returns and conditional branches and
+    switches, i.e. the sync points. A value that reaches none of them is
+    dead and cannot corrupt anything.
+      reach(v)   sinks reachable from v
+      direct(v)  sinks reachable without passing through a masking use:
+                 a compare, a trunc, or an and/shift by a constant, which
+                 let only some of the bits of v through
+      rank(v)  = |reach(v)| + |direct(v)|
+    Both sets are bitsets over the function's sinks (folded onto at most
+    MaxSinks bits in huge functions, which only undercounts), grown to a
+    fixpoint by walking the function backwards; phis make that take a few
+    rounds.
+*/
+static const unsigned MaxSinks = 4096;
+
+static bool isMaskingUse(Instruction *user) {
+  if (isa<CmpInst>(user) || isa<TruncInst>(user))
+    return true;
+  switch (user->getOpcode()) {
+  case Instruction::And:
+  case Instruction::Shl:
+  case Instruction::LShr:
+  case Instruction::AShr:
+    return isa<Constant>(user->getOperand(1));
+  default:
+    return false;
+  }
+}
+
+static bool isSink(Instruction *inst) {
+  return isa<StoreInst>(inst) || isa<CallBase>(inst) || isa<ReturnInst>(inst) || isa<SwitchInst>(inst) ||
+         (isa<BranchInst>(inst) && cast<BranchInst>(inst)->isConditional());
+}
+
+static void RankVulnerability(FunctionPlan &P) {
+  std::vector<Instruction*> insts;
+  DenseMap<Instruction*, unsigned> index;
+  unsigned nSinks = 0;
+  for (Instruction &inst : instructions(P.F)) {
+    index[&inst] = insts.size();
+    insts.push_back(&inst);
+    if (isSink(&inst))
+      nSinks++;
+  }
+  unsigned width = std::max(1u, std::min(nSinks, MaxSinks));
+
+  std::vector<BitVector> reach(insts.size(), BitVector(width));
+  std::vector<BitVector> direct(insts.size(), BitVector(width));
+  unsigned sink = 0;
+  for (unsigned i = 0; i < insts.size(); i++)
+    if (isSink(insts[i])) {
+      reach[i].set(sink % width);
+      direct[i].set(sink % width);
+      sink++;
+    }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (unsigned i = insts.size(); i-- > 0;) {
+      for (User *U : insts[i]->users()) {
+        Instruction *user = dyn_cast<Instruction>(U);
+        if (!user || user->getFunction() != P.F)
+          continue;
+        unsigned u = index.lookup(user);
+        // test: bits of the user's set that are not in ours yet
+        if (reach[u].test(reach[i])) {
+          reach[i] |= reach[u];
+          changed = true;
+        }
+        if (!isMaskingUse(user) && direct[u].test(direct[i])) {
+          direct[i] |= direct[u];
+          changed = true;
         }
+      }
+    }
+  }
+
+  for (unsigned i = 0; i < insts.size(); i++)
+    if (isReplicable(*insts[i]))
+      P.ranks.push_back({insts[i], reach[i].count() + direct[i].count()});
+}
+
+static void PlanFunction(FunctionPlan &P) {
+  // at most one check per block for control flow, and per instruction one
+  // for its value or one for each operand at a sync point
+  for (BasicBlock &bscblk : *P.F) {
+    P.nUIDs++;
+    for (Instruction &inst : bscblk)
+      P.nUIDs += 1 + inst.getNumOperands();
+  }
+  if (!NoControlProtection && CfgChecks == CfgLoops) {
+    DominatorTree DT(*P.F);
+    LoopInfo LI(DT);
+    for (Loop *L : LI.getLoopsInPreorder())
+      P.loopHeaders.push_back(L->getHeader());
+  }
+  if (ProtectBudget < 100)
+    RankVulnerability(P);
+  if (ProfileUse == "ir") {
+    // block frequencies scaled by the entry count clang's profile left
+    DominatorTree DT(*P.F);
+    LoopInfo LI(DT);
+    BranchProbabilityInfo BPI(*P.F, LI);
+    BlockFrequencyInfo BFI(*P.F, BPI, LI);
+    for (BasicBlock &bscblk : *P.F) {
+      auto count = BFI.getBlockProfileCount(&bscblk);
+      P.blockCounts[&bscblk] = count ? *count : 0;
     }
   }
 }
 
+/*  -check-profile: once a function's checks are final, each one gets
+      atomicrmw add i64* @p3.check.counts[k], 1 monotonic
+    right before its call to assert_ft / assert_cfg_ft, or before the
+    branch that leads to the failure block with -inline-checks, so
+    counts[k] is the number of times check k ran. The counters are
+    indexed through a placeholder global until all functions are done, as
+    for -tmr-votes.
+*/
+GlobalVariable *checkCounts = nullptr;
+std::vector<std::string> checkLabels;
+
+// the blocks of a function before protection, with the names used in the labels
+static DenseMap<BasicBlock*, std::string> CheckSiteBlocks(Function *F) {
+  DenseMap<BasicBlock*, std::string> names;
+  unsigned idx = 0;
+  for (BasicBlock &bscblk : *F) {
+    names[&bscblk] = bscblk.hasName() ? bscblk.getName().str() : "#" + std::to_string(idx);
+    idx++;
+  }
+  return names;
+}
+
+// the block a check site was made for: blocks split off by the checks
+// reach it through single predecessors
+static StringRef CheckSiteBlock(BasicBlock *bscblk, const DenseMap<BasicBlock*, std::string> &names) {
+  SmallPtrSet<BasicBlock*, 8> seen;
+  for (BasicBlock *b = bscblk; b && seen.insert(b).second; b = b->getSinglePredecessor()) {
+    auto name = names.find(b);
+    if (name != names.end())
+      return name->second;
+  }
+  return "?";
+}
+
+static void CountChecks(Function *F, const DenseMap<BasicBlock*, std::string> &names) {
+  BasicBlock *fail = failBlocks.count(F) ? failBlocks[F] : nullptr;
+  std::vector<std::tuple<Instruction*, ConstantInt*, const char*>> sites;
+  for (BasicBlock &bscblk : *F)
+    for (Instruction &inst : bscblk) {
+      if (CallInst *call = dyn_cast<CallInst>(&inst)) {
+        Function *callee = call->getCalledFunction();
+        if (callee == AssertFT.getCallee() || callee == AssertCFG.getCallee())
+          sites.push_back({call, cast<ConstantInt>(call->getArgOperand(1)),
+                           callee == AssertFT.getCallee() ? "data" : "cfg"});
+      } else if (BranchInst *br = dyn_cast<BranchInst>(&inst)) {
+        if (fail && br->isConditional() && br->getSuccessor(1) == fail)
+          sites.push_back({br, cast<ConstantInt>(cast<PHINode>(&fail->front())->getIncomingValueForBlock(&bscblk)),
+                           br->getMetadata("ft.cfg") ? "cfg" : "data"});
+      }
+    }
+
+  Type *i64 = Type::getInt64Ty(F->getContext());
+  for (auto &site : sites) {
+    Instruction *insertPt = std::get<0>(site);
+    IRBuilder<> Builder(insertPt);
+    Value *ptr = Builder.CreateConstInBoundsGEP1_64(i64, checkCounts, checkLabels.size());
+    Builder.CreateAtomicRMW(AtomicRMWInst::Add, ptr, Builder.getInt64(1), MaybeAlign(8), AtomicOrdering::Monotonic);
+    checkLabels.push_back((F->getName() + " " + CheckSiteBlock(insertPt->getParent(), names) + " " +
+                           Twine(std::get<1>(site)->getZExtValue()) + " " + std::get<2>(site)).str());
+    SWFTAdded++;
+  }
+}
+
+// counters indexed through a placeholder: the real array, and the dump of it at exit
+static void FinishCounters(Module *M, GlobalVariable *&placeholder, ArrayRef<std::string> labels,
+                           StringRef name, StringRef path) {
+  ArrayType *countsTy = ArrayType::get(placeholder->getValueType(), labels.size());
+  GlobalVariable *counts = new GlobalVariable(*M, countsTy, false, GlobalValue::InternalLinkage,
+                                              ConstantAggregateZero::get(countsTy), name);
+  Constant *zero = ConstantInt::get(Type::getInt64Ty(M->getContext()), 0);
+  placeholder->replaceAllUsesWith(ConstantExpr::getInBoundsGetElementPtr(countsTy, counts, ArrayRef<Constant*>{zero, zero}));
+  placeholder->eraseFromParent();
+  placeholder = nullptr;
+  BuildCounterDump(M, counts, labels, path, ("p3.dump." + name.drop_front(3)).str());
+}
+
+// -profile-use: instructions the profiled runs executed, and how many more
+// they would have executed protected
+uint64_t dynamicInsts = 0;
+uint64_t dynamicAdded = 0;
+
+static void ProtectFunction(FunctionPlan &P) {
+  Function *F = P.F;
+  cloneMap.clear();
+  cloneMap2.clear();
+  // UIDs depend only on the function's position in the module
+  my_UID = P.firstUID;
+
+  // the original instructions of the hot blocks, which stay where they are
+  // while the blocks get split
+  DenseSet<Instruction*> hot;
+  uint64_t dynamicBefore = 0;
+  DenseMap<BasicBlock*, std::string> blockNames;
+  if (checkCounts)
+    blockNames = CheckSiteBlocks(F);
+  if (!ProfileUse.empty()) {
+    for (BasicBlock *bscblk : P.hotBlocks)
+      for (Instruction &inst : *bscblk)
+        hot.insert(&inst);
+    dynamicBefore = DynamicInstructions(F, P.blockCounts);
+  }
+
+  //Here I am only cloning instructions and setting the operands
+  CloneInstAndSetOperands(F, P.skip);
+  if (SimdDup)
+    PackClonesIntoLanes(F);
+  if (ReOpt) {
+    HideCloneRoots(F, cloneMap, 0);
+    HideCloneRoots(F, cloneMap2, 1);
+  }
+
+  // signatures go on the CFG before the inline checks split it: the
+  // split-off blocks just inherit the signature of the block they came from
+  if (!NoControlProtection)
+    VerifyCfg(F, P.loopHeaders);
+
+  if (!ProfileUse.empty()) {
+    // cold blocks check every value, values made in hot blocks are checked
+    // where they leave the duplicated code, also if that is in a cold block
+    InsertEveryInstChecks(F, &hot);
+    InsertSyncPointChecks(F, &hot, P.skip);
+  }
+  // votes replace values, they cannot be put off to the end of a block
+  else if (Checks == SyncPoints || (Tmr && Checks != EveryInst)) {
+    InsertSyncPointChecks(F, nullptr, P.skip);
+  }
+  else if (Checks == BlockSignature) {
+    InsertBlockSignatureChecks(F);
+  }
+  else if (Checks == LoopAccumulated) {
+    InsertLoopAccumulatedChecks(F);
+  }
+  else {
+    InsertEveryInstChecks(F, nullptr);
+  }
+
+  if (ElimRedundantChecks)
+    EliminateRedundantChecks(F);
+  if (SimdDup)
+    DropUnusedLanes();
+  if (ReOpt)
+    HideCheckOperands(F);
+  if (checkCounts)
+    CountChecks(F, blockNames);
+  assert(my_UID <= P.firstUID + P.nUIDs && "UID range of function exceeded");
+
+  if (!ProfileUse.empty()) {
+    dynamicInsts += dynamicBefore;
+    dynamicAdded += DynamicInstructions(F, P.blockCounts) - dynamicBefore;
+  }
+}
 
 static void SoftwareFaultTolerance(Module *M) {
+  if (InlineChecks)
+    AssertFail = BuildAssertFail(M);
+  if (ReOpt) {
+    // keep the checks recognizable (and small) through the second O2
+    cast<Function>(AssertFT.getCallee())->addFnAttr(Attribute::NoInline);
+    cast<Function>(AssertCFG.getCallee())->addFnAttr(Attribute::NoInline);
+  }
+
   Module::FunctionListType &list = M->getFunctionList();
 
-  std::vector<Function*> flist;
+  std::vector<FunctionPlan> plans;
   // FIND THE ASSERT FUNCTIONS AND DO NOT INSTRUMENT THEM
   for(Module::FunctionListType::iterator it = list.begin(); it!=list.end(); it++) {
     Function *fptr = &*it;
-    if (fptr->size() > 0 && fptr != AssertFT.getCallee() && fptr != AssertCFG.getCallee())
-      flist.push_back(fptr);
+    if (fptr->size() > 0 && fptr != AssertFT.getCallee() && fptr != AssertCFG.getCallee() && fptr != AssertFail.getCallee()) {
+      FunctionPlan P;
+      P.F = fptr;
+      plans.push_back(std::move(P));
+    }
+  }
+
+  if (!ProfileUse.empty() && ProfileUse != "ir") {
+    auto profile = ReadBlockProfile(ProfileUse);
+    for (FunctionPlan &P : plans) {
+      auto counts = profile.find(P.F->getName().str());
+      if (counts == profile.end())
+        continue;
+      if (counts->second.rbegin()->first >= P.F->size()) {
+        errs() << "p3: profile does not match " << P.F->getName() << ", its blocks are taken as cold\n";
+        continue;
+      }
+      unsigned n = 0;
+      for (BasicBlock &bscblk : *P.F) {
+        auto c = counts->second.find(n++);
+        P.blockCounts[&bscblk] = c == counts->second.end() ? 0 : c->second;
+      }
+    }
+  }
+
+  if (Jobs == 1) {
+    for (FunctionPlan &P : plans)
+      PlanFunction(P);
+  } else {
+    ThreadPool Pool(hardware_concurrency(Jobs));
+    for (FunctionPlan &P : plans)
+      Pool.async([&P] { PlanFunction(P); });
+    Pool.wait();
+  }
+
+  // -protect-budget: take the top ranked instructions of the whole module
+  // (ties go to the one earlier in the module) until the budget is used up.
+  // Where a selected value flows into an instruction that is not, the
+  // checks treat that user as a sync point.
+  if (ProtectBudget < 100) {
+    std::vector<std::pair<unsigned, Instruction*>> order;
+    for (FunctionPlan &P : plans)
+      for (auto &r : P.ranks)
+        order.push_back({r.second, r.first});
+    std::stable_sort(order.begin(), order.end(),
+                     [](const auto &a, const auto &b) { return a.first > b.first; });
+
+    size_t keep = (order.size() * ProtectBudget + 99) / 100;
+    DenseSet<Instruction*> selected;
+    for (size_t k = 0; k < keep; k++)
+      selected.insert(order[k].second);
+
+    for (FunctionPlan &P : plans)
+      for (auto &r : P.ranks)
+        if (!selected.count(r.first)) {
+          P.skip.insert(r.first);
+          SWFTSkipped++;
+        }
+  }
+
+  // -profile-use: hot are the most frequent blocks that together run
+  // -profile-hot percent of the profiled instructions
+  if (!ProfileUse.empty()) {
+    std::vector<std::pair<uint64_t, std::pair<FunctionPlan*, BasicBlock*>>> blocks;
+    double total = 0;
+    for (FunctionPlan &P : plans)
+      for (BasicBlock &bscblk : *P.F) {
+        uint64_t count = P.blockCounts.lookup(&bscblk);
+        total += (double)count * bscblk.size();
+        if (count > 0)
+          blocks.push_back({count, {&P, &bscblk}});
+      }
+    std::stable_sort(blocks.begin(), blocks.end(),
+                     [](const auto &a, const auto &b) { return a.first > b.first; });
+
+    double hot = 0;
+    for (auto &b : blocks) {
+      if (hot >= total * ProfileHot / 100)
+        break;
+      b.second.first->hotBlocks.insert(b.second.second);
+      hot += (double)b.first * b.second.second->size();
+      ProfileHotBlocks++;
+    }
+  }
+
+  if (Tmr && !TmrVotes.empty())
+    tmrVoteCounts = new GlobalVariable(*M, Type::getInt64Ty(M->getContext()), false, GlobalValue::InternalLinkage,
+                                       ConstantInt::get(Type::getInt64Ty(M->getContext()), 0), "p3.tmr.votes.tmp");
+  if (!CheckProfile.empty())
+    checkCounts = new GlobalVariable(*M, Type::getInt64Ty(M->getContext()), false, GlobalValue::InternalLinkage,
+                                     ConstantInt::get(Type::getInt64Ty(M->getContext()), 0), "p3.check.counts.tmp");
+
+  // consecutive UID ranges in module order
+  uint32_t uid = my_UID;
+  for (FunctionPlan &P : plans) {
+    P.firstUID = uid;
+    uid += P.nUIDs;
   }
 
   // PROTECT CODE IN EACH FUNCTION
-  for(std::vector<Function*>::iterator it=flist.begin(); it!=flist.end(); it++)
-    {
-      // CALL A FUNCTION TO REPLICATE CODE in *it
-      //Here I am only cloning instructions and setting the operands
-      CloneInstAndSetOperands(*it);
-      // VerifyCfg(*it);
+  for (FunctionPlan &P : plans)
+    ProtectFunction(P);
+
+  // one counter per vote and per check, now that they are all in
+  if (tmrVoteCounts)
+    FinishCounters(M, tmrVoteCounts, tmrVoteLabels, "p3.tmr.votes", TmrVotes);
+  if (checkCounts)
+    FinishCounters(M, checkCounts, checkLabels, "p3.check.counts", CheckProfile);
+
+  if (dynamicInsts > 0)
+    SWFTDynOverhead = (dynamicAdded * 100 + dynamicInsts / 2) / dynamicInsts;
+}
+
+/*  -srmt: redundant multithreading. Every protected function F gets a
+    leading copy F.lead and a trailing copy F.trail, and main becomes
+      main(args): save args; srmt_start(@p3.srmt.trail);
+                  r = main.lead(args); srmt_join(); ret r
+    where @p3.srmt.trail runs main.trail on the saved args on a second
+    thread. A direct call to a protected function calls its lead copy from
+    a lead copy and its trail copy from a trail copy, so both threads walk
+    the same path; the originals stay for everybody else. The threads talk
+    through the ring of runtime/srmt.c, per instruction of F:
+      alloca      lead sends the address, trail uses it instead of its own
+      load        lead sends address and value; trail checks the address
+                  and takes the value instead of loading
+      store       lead sends address and value; trail checks both, and
+                  does not store
+      br, switch  lead sends the condition, trail checks it
+      ret         of main: lead sends the exit code, trail checks it, so it
+                  is verified before srmt_join returns
+      call        of anything else: lead sends the arguments, waits at a
+                  barrier if the callee may write memory, calls, and sends
+                  the result; trail checks the arguments and takes the result
+      the rest    both compute it
+    Values travel as 64-bit slots, wider ones as several. A function is
+    protected if all those values are scalars or vectors and it has no
+    exception handling, atomics, indirectbr or setjmp, and main reaches it
+    through direct calls of protected functions.
+*/
+static llvm::Statistic SRMTFunctions = {"", "SRMTFunctions", "functions run by a leading and a trailing thread by -srmt"};
+static llvm::Statistic SRMTChecks = {"", "SRMTChecks", "values the trailing thread of -srmt verifies"};
+
+// values that fit in ring slots: pointers, and anything with the bits of an integer
+static bool isSlotType(Type *T) {
+  if (T->isPointerTy())
+    return true;
+  if (isa<ScalableVectorType>(T) || (T->isVectorTy() && cast<VectorType>(T)->getElementType()->isPointerTy()))
+    return false;
+  return T->isIntOrIntVectorTy() || T->isFPOrFPVectorTy();
+}
+
+static std::vector<Value*> ToSlots(IRBuilder<> &Builder, Value *v) {
+  Type *i64 = Builder.getInt64Ty();
+  if (v->getType()->isPointerTy())
+    return {Builder.CreatePtrToInt(v, i64)};
+  unsigned bits = v->getType()->getPrimitiveSizeInBits().getFixedSize();
+  Value *n = Builder.CreateBitCast(v, Builder.getIntNTy(bits));
+  std::vector<Value*> slots;
+  for (unsigned lo = 0; lo < bits; lo += 64)
+    slots.push_back(Builder.CreateZExtOrTrunc(lo ? Builder.CreateLShr(n, lo) : n, i64));
+  return slots;
+}
+
+static Value *FromSlots(IRBuilder<> &Builder, ArrayRef<Value*> slots, Type *T) {
+  if (T->isPointerTy())
+    return Builder.CreateIntToPtr(slots[0], T);
+  Type *iN = Builder.getIntNTy(T->getPrimitiveSizeInBits().getFixedSize());
+  Value *n = Builder.CreateZExtOrTrunc(slots[0], iN);
+  for (unsigned k = 1; k < slots.size(); k++)
+    n = Builder.CreateOr(n, Builder.CreateShl(Builder.CreateZExt(slots[k], iN), 64 * k));
+  return Builder.CreateBitCast(n, T);
+}
+
+enum SrmtCall { SrmtBoth, SrmtPaired, SrmtLeadOnly, SrmtHint };
+
+static SrmtCall ClassifySrmtCall(CallInst *CI, const DenseSet<Function*> &protectedFuncs) {
+  Function *callee = CI->getCalledFunction();
+  if (callee && protectedFuncs.count(callee))
+    return SrmtPaired;
+  // debug info and lifetime markers would refer to the leading thread's memory
+  if (isa<DbgInfoIntrinsic>(CI) || CI->isLifetimeStartOrEnd())
+    return SrmtHint;
+  if (CI->doesNotAccessMemory() && !CI->isInlineAsm() && !CI->mayHaveSideEffects())
+    return SrmtBoth;
+  return SrmtLeadOnly;
+}
+
+static bool isSrmtCandidate(Function &F) {
+  if (F.isDeclaration() || F.isVarArg() || &F == AssertFT.getCallee() || &F == AssertCFG.getCallee())
+    return false;
+  for (Instruction &I : instructions(F)) {
+    if (I.isEHPad() || isa<InvokeInst>(I) || isa<CallBrInst>(I) || isa<IndirectBrInst>(I) ||
+        isa<AtomicRMWInst>(I) || isa<AtomicCmpXchgInst>(I) || isa<FenceInst>(I) || I.isAtomic())
+      return false;
+    if (isa<LoadInst>(I) && !isSlotType(I.getType()))
+      return false;
+    if (isa<StoreInst>(I) && !isSlotType(cast<StoreInst>(I).getValueOperand()->getType()))
+      return false;
+    if (CallInst *CI = dyn_cast<CallInst>(&I)) {
+      if (CI->hasFnAttr(Attribute::ReturnsTwice) || CI->isMustTailCall())
+        return false;
+      // the result of a call only the leading thread makes has to be sent;
+      // calls of other candidates are not known yet and are judged the same way
+      if (!CI->getType()->isVoidTy() && !isSlotType(CI->getType()) &&
+          ClassifySrmtCall(CI, {}) == SrmtLeadOnly)
+        return false;
     }
+  }
+  return true;
+}
 
-    
-    if(!cloneMap.empty()){
-      for (const auto& c : cloneMap) {
-        //fprintf(stderr, "\t%s %d\n",__FILE__, __LINE__);
-        Instruction* orign_inst = c.first;
-        Instruction* clone_inst = c.second;
-
-        Value* orig_val     = orign_inst;
-        Value* clone_value  = clone_inst;
-
-        BasicBlock *bscblk = orign_inst->getParent();
-        IRBuilder<> Builder(bscblk);
-        //if it is a PHI instruction, set insertPoint at the first non-phi instruction
-        (orign_inst->getOpcode() == Instruction::PHI) ? Builder.SetInsertPoint(orign_inst->getParent()->getFirstNonPHI()) : Builder.SetInsertPoint(orign_inst->getNextNode());
-
-        //check the cloned or original instruction is of integer or pointer type, and based
-        //on that; insert ICMPEQ, ZEXT and ASSERT instruction for it.
-        if(orig_val->getType()->isIntegerTy() || clone_value->getType()->isIntegerTy() || 
-            orig_val->getType()->isPointerTy() || clone_value->getType()->isPointerTy())
-        {
-          Value* ret = Builder.CreateICmpEQ(orign_inst, clone_inst);
-          SWFTAdded++;
-          Value* zextRetVal = Builder.CreateZExt(ret, IntegerType::getInt32Ty(getGlobalContext()));
-          SWFTAdded++;
-          std::vector<Value*> args_for_assert;
-          args_for_assert.push_back(zextRetVal);
-          args_for_assert.push_back(Builder.getInt32(my_UID));
-          Function *F = M->getFunction("assert_ft");
-          Builder.CreateCall(F->getFunctionType(), F, args_for_assert);
-          SWFTAdded++;
-          //Global Variable UID is used to assihn it for ZEXT
-          my_UID++;
+// the leading thread sends v
+static void SrmtSend(Instruction *insertPt, Value *v, FunctionCallee push) {
+  IRBuilder<> Builder(insertPt);
+  for (Value *slot : ToSlots(Builder, v))
+    Builder.CreateCall(push, {slot});
+}
+
+// the trailing thread compares v with what the leading thread sent
+static void SrmtCheck(Instruction *insertPt, Value *v, FunctionCallee check) {
+  IRBuilder<> Builder(insertPt);
+  for (Value *slot : ToSlots(Builder, v))
+    Builder.CreateCall(check, {slot, Builder.getInt32(my_UID)});
+  my_UID++;
+  SRMTChecks++;
+}
+
+// the trailing thread takes a value of type T from the leading thread
+static Value *SrmtReceive(Instruction *insertPt, Type *T, FunctionCallee pop) {
+  IRBuilder<> Builder(insertPt);
+  unsigned n = T->isPointerTy() ? 1 : (T->getPrimitiveSizeInBits().getFixedSize() + 63) / 64;
+  std::vector<Value*> slots;
+  for (unsigned k = 0; k < n; k++)
+    slots.push_back(Builder.CreateCall(pop));
+  return FromSlots(Builder, slots, T);
+}
+
+// what O2 inferred about F, or a call of it, before it talked to the other
+// thread: without this it would drop calls of a readnone trail copy
+static const Attribute::AttrKind SrmtStaleAttrs[] = {
+  Attribute::ReadNone, Attribute::ReadOnly, Attribute::WriteOnly, Attribute::ArgMemOnly,
+  Attribute::InaccessibleMemOnly, Attribute::InaccessibleMemOrArgMemOnly, Attribute::NoSync,
+  Attribute::WillReturn};
+
+static void RedundantMultithreading(Module *M) {
+  LLVMContext &C = M->getContext();
+  Type *i64 = Type::getInt64Ty(C);
+  Type *voidTy = Type::getVoidTy(C);
+  Function *Main = M->getFunction("main");
+  if (Main == nullptr || !isSrmtCandidate(*Main)) {
+    errs() << "p3: -srmt: main cannot be protected, the program is left as it is\n";
+    return;
+  }
+
+  // main and the candidates it reaches through direct calls
+  DenseSet<Function*> protectedFuncs;
+  std::vector<Function*> funcs, worklist = {Main};
+  while (!worklist.empty()) {
+    Function *F = worklist.back();
+    worklist.pop_back();
+    if (!protectedFuncs.insert(F).second)
+      continue;
+    funcs.push_back(F);
+    for (Instruction &I : instructions(F))
+      if (CallInst *CI = dyn_cast<CallInst>(&I))
+        if (Function *callee = CI->getCalledFunction())
+          if (!protectedFuncs.count(callee) && isSrmtCandidate(*callee))
+            worklist.push_back(callee);
+  }
+
+  FunctionCallee push = M->getOrInsertFunction("srmt_push", voidTy, i64);
+  FunctionCallee pop = M->getOrInsertFunction("srmt_pop", i64);
+  FunctionCallee check = M->getOrInsertFunction("srmt_check", voidTy, i64, Type::getInt32Ty(C));
+  FunctionCallee barrierLead = M->getOrInsertFunction("srmt_barrier_lead", voidTy);
+  FunctionCallee barrierTrail = M->getOrInsertFunction("srmt_barrier_trail", voidTy);
+
+  // all copies first, calls are redirected between them
+  DenseMap<Function*, Function*> lead, trail;
+  DenseMap<Function*, std::unique_ptr<ValueToValueMapTy>> leadMap, trailMap;
+  for (Function *F : funcs) {
+    leadMap[F] = std::make_unique<ValueToValueMapTy>();
+    trailMap[F] = std::make_unique<ValueToValueMapTy>();
+    lead[F] = CloneFunction(F, *leadMap[F]);
+    trail[F] = CloneFunction(F, *trailMap[F]);
+    lead[F]->setName(F->getName() + ".lead");
+    trail[F]->setName(F->getName() + ".trail");
+    lead[F]->setLinkage(GlobalValue::InternalLinkage);
+    trail[F]->setLinkage(GlobalValue::InternalLinkage);
+    for (Attribute::AttrKind kind : SrmtStaleAttrs) {
+      lead[F]->removeFnAttr(kind);
+      trail[F]->removeFnAttr(kind);
+    }
+  }
+
+  for (Function *F : funcs) {
+    ValueToValueMapTy &LV = *leadMap[F], &TV = *trailMap[F];
+    for (Instruction &I : instructions(F)) {
+      Instruction *li = cast<Instruction>(LV[&I]);
+      Instruction *ti = cast<Instruction>(TV[&I]);
+
+      if (isa<AllocaInst>(I) || isa<LoadInst>(I)) {
+        // sent right after the leading thread made them
+        Instruction *after = li->getNextNode();
+        if (LoadInst *load = dyn_cast<LoadInst>(li)) {
+          SrmtSend(after, load->getPointerOperand(), push);
+          SrmtCheck(ti, cast<LoadInst>(ti)->getPointerOperand(), check);
+        }
+        SrmtSend(after, li, push);
+        ti->replaceAllUsesWith(SrmtReceive(ti, ti->getType(), pop));
+        ti->eraseFromParent();
+      } else if (isa<StoreInst>(I)) {
+        for (unsigned op : {1, 0}) {
+          SrmtSend(li, li->getOperand(op), push);
+          SrmtCheck(ti, ti->getOperand(op), check);
+        }
+        ti->eraseFromParent();
+      } else if ((isa<BranchInst>(I) && cast<BranchInst>(I).isConditional()) || isa<SwitchInst>(I) ||
+                 (F == Main && isa<ReturnInst>(I) && I.getNumOperands() > 0)) {
+        SrmtSend(li, li->getOperand(0), push);
+        SrmtCheck(ti, ti->getOperand(0), check);
+      } else if (CallInst *CI = dyn_cast<CallInst>(&I)) {
+        switch (ClassifySrmtCall(CI, protectedFuncs)) {
+        case SrmtBoth:
+          break;
+        case SrmtPaired:
+          cast<CallInst>(li)->setCalledFunction(lead[CI->getCalledFunction()]);
+          cast<CallInst>(ti)->setCalledFunction(trail[CI->getCalledFunction()]);
+          for (Attribute::AttrKind kind : SrmtStaleAttrs) {
+            cast<CallInst>(li)->removeFnAttr(kind);
+            cast<CallInst>(ti)->removeFnAttr(kind);
+          }
+          break;
+        case SrmtHint:
+          ti->eraseFromParent();
+          break;
+        case SrmtLeadOnly: {
+          CallInst *lc = cast<CallInst>(li), *tc = cast<CallInst>(ti);
+          // for indirect calls this includes the target
+          for (unsigned op = 0; op < lc->getNumOperands(); op++) {
+            if (!isSlotType(lc->getOperand(op)->getType()) || isa<Function>(lc->getOperand(op)))
+              continue;
+            SrmtSend(lc, lc->getOperand(op), push);
+            SrmtCheck(tc, tc->getOperand(op), check);
+          }
+          // the callee may write memory, or do I/O
+          if (!isa<IntrinsicInst>(CI) && !CI->onlyReadsMemory()) {
+            CallInst::Create(barrierLead, "", lc);
+            CallInst::Create(barrierTrail, "", tc);
+          }
+          if (!CI->getType()->isVoidTy()) {
+            SrmtSend(lc->getNextNode(), lc, push);
+            tc->replaceAllUsesWith(SrmtReceive(tc, tc->getType(), pop));
+          }
+          tc->eraseFromParent();
+          break;
+        }
         }
       }
     }
+    SWFTAdded += lead[F]->getInstructionCount() + trail[F]->getInstructionCount() - F->getInstructionCount();
+    SRMTFunctions++;
+  }
+
+  // the trailing thread's main, with main's arguments passed through globals
+  std::vector<GlobalVariable*> args;
+  for (Argument &arg : Main->args())
+    args.push_back(new GlobalVariable(*M, arg.getType(), false, GlobalValue::InternalLinkage,
+                                      Constant::getNullValue(arg.getType()), "p3.srmt.arg"));
+  Function *trailMain = Function::Create(FunctionType::get(voidTy, false), GlobalValue::InternalLinkage,
+                                         "p3.srmt.trail", M);
+  IRBuilder<> Builder(BasicBlock::Create(C, "entry", trailMain));
+  std::vector<Value*> trailArgs;
+  for (GlobalVariable *arg : args)
+    trailArgs.push_back(Builder.CreateLoad(arg->getValueType(), arg));
+  Builder.CreateCall(trail[Main], trailArgs);
+  Builder.CreateRetVoid();
+
+  FunctionCallee start = M->getOrInsertFunction("srmt_start", voidTy, trailMain->getType());
+  FunctionCallee join = M->getOrInsertFunction("srmt_join", voidTy);
+  Main->dropAllReferences();
+  while (!Main->empty())
+    Main->begin()->eraseFromParent();
+  Builder.SetInsertPoint(BasicBlock::Create(C, "entry", Main));
+  std::vector<Value*> leadArgs;
+  for (Argument &arg : Main->args()) {
+    Builder.CreateStore(&arg, args[arg.getArgNo()]);
+    leadArgs.push_back(&arg);
+  }
+  Builder.CreateCall(start, {trailMain});
+  Value *ret = Builder.CreateCall(lead[Main], leadArgs);
+  Builder.CreateCall(join);
+  if (ret->getType()->isVoidTy())
+    Builder.CreateRetVoid();
+  else
+    Builder.CreateRet(ret);
 }
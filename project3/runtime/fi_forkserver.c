@@ -0,0 +1,176 @@
+/*  Fork server for binaries built from fi -runtime-select -fork-server=<fn>.
+
+    fi puts a call to fi_fork_server() at the start of <fn>. Without
+    FI_FORK_SERVER in the environment the call does nothing. With it, the
+    process that reaches the marker first becomes a server: it forks one
+    child per fault ID listed in FI_FORK_IDS, so every run starts from the
+    warm state at the marker instead of from main. Each child sets
+    fi_fault_id and returns from the marker with its stdout going to
+    $FI_FORK_OUT/<n>.out; the server never returns and exits 0 once every
+    child has been reaped.
+
+      FI_FORK_IDS      file with one fault ID per line (0 = no fault)
+      FI_FORK_OUT      directory for the children's output
+      FI_FORK_RESULTS  file the server writes, one line per ID, in order:
+                         <n> <id> <exit code> <signal> <timed out> <seconds>
+      FI_FORK_JOBS     children running at the same time (default 1)
+      FI_FORK_TIMEOUT  seconds before a child is killed (default: none)
+*/
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* defined by fi -runtime-select */
+extern int fi_fault_id;
+
+struct child {
+  pid_t pid;
+  int n;
+  double start;
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int read_ids(const char *path, int **ids) {
+  FILE *f = fopen(path, "r");
+  int n = 0, cap = 1024, id;
+  if (!f)
+    return -1;
+  *ids = malloc(cap * sizeof(int));
+  while (fscanf(f, "%d", &id) == 1) {
+    if (n == cap) {
+      cap *= 2;
+      *ids = realloc(*ids, cap * sizeof(int));
+    }
+    (*ids)[n++] = id;
+  }
+  fclose(f);
+  return n;
+}
+
+/* the child: continue the program with the n-th fault */
+static void become_child(const char *outDir, int n, int id) {
+  char path[4096];
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%d.out", outDir, n);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    _exit(127);
+  dup2(fd, 1);
+  close(fd);
+  fd = open("/dev/null", O_WRONLY);
+  if (fd >= 0) {
+    dup2(fd, 2);
+    close(fd);
+  }
+  fi_fault_id = id;
+}
+
+void fi_fork_server(void) {
+  static int started = 0;
+  const char *outDir, *resultsPath, *env;
+  int *ids, numIds, jobs, next = 0, running = 0, i;
+  double timeout;
+  struct child *children;
+  FILE *results;
+  int *exitCodes, *signals, *timedOut;
+  double *seconds;
+
+  if (started || !getenv("FI_FORK_SERVER"))
+    return;
+  started = 1;
+
+  outDir = getenv("FI_FORK_OUT");
+  resultsPath = getenv("FI_FORK_RESULTS");
+  if (!outDir || !resultsPath || !getenv("FI_FORK_IDS") ||
+      (numIds = read_ids(getenv("FI_FORK_IDS"), &ids)) < 0) {
+    fprintf(stderr, "fi_fork_server: FI_FORK_IDS, FI_FORK_OUT and FI_FORK_RESULTS must be set\n");
+    _exit(2);
+  }
+  env = getenv("FI_FORK_JOBS");
+  jobs = env && atoi(env) > 0 ? atoi(env) : 1;
+  env = getenv("FI_FORK_TIMEOUT");
+  timeout = env ? atof(env) : 0;
+
+  children = calloc(jobs, sizeof(struct child));
+  exitCodes = calloc(numIds, sizeof(int));
+  signals = calloc(numIds, sizeof(int));
+  timedOut = calloc(numIds, sizeof(int));
+  seconds = calloc(numIds, sizeof(double));
+
+  /* whatever the program buffered so far must not be written by every child */
+  fflush(NULL);
+
+  while (next < numIds || running > 0) {
+    int status, slot;
+    pid_t pid;
+
+    /* start children while there are free slots */
+    for (slot = 0; slot < jobs && next < numIds; slot++) {
+      if (children[slot].pid != 0)
+        continue;
+      pid = fork();
+      if (pid == 0) {
+        become_child(outDir, next, ids[next]);
+        return;
+      }
+      if (pid < 0) {
+        exitCodes[next] = 127;
+      } else {
+        children[slot].pid = pid;
+        children[slot].n = next;
+        children[slot].start = now();
+        running++;
+      }
+      next++;
+    }
+
+    pid = waitpid(-1, &status, WNOHANG);
+    if (pid <= 0) {
+      /* nothing finished: kill the children that ran out of time */
+      double t = now();
+      for (slot = 0; slot < jobs; slot++)
+        if (children[slot].pid != 0 && timeout > 0 && t - children[slot].start > timeout &&
+            !timedOut[children[slot].n]) {
+          timedOut[children[slot].n] = 1;
+          kill(children[slot].pid, SIGKILL);
+        }
+      usleep(200);
+      continue;
+    }
+
+    for (slot = 0; slot < jobs; slot++)
+      if (children[slot].pid == pid)
+        break;
+    if (slot == jobs)
+      continue;
+    i = children[slot].n;
+    seconds[i] = now() - children[slot].start;
+    if (WIFEXITED(status))
+      exitCodes[i] = WEXITSTATUS(status);
+    else if (WIFSIGNALED(status))
+      signals[i] = WTERMSIG(status);
+    children[slot].pid = 0;
+    running--;
+  }
+
+  results = fopen(resultsPath, "w");
+  if (!results)
+    _exit(2);
+  for (i = 0; i < numIds; i++)
+    fprintf(results, "%d %d %d %d %d %.6f\n", i, ids[i], exitCodes[i], signals[i], timedOut[i],
+            seconds[i]);
+  fclose(results);
+  _exit(0);
+}
@@ -0,0 +1,161 @@
+/*  Runtime for programs protected by p3 -srmt (redundant multithreading).
+
+    p3 makes a leading and a trailing copy of the protected functions and
+    turns main into
+      srmt_start(trail);  r = main.lead(...);  srmt_join();  return r;
+    where trail runs main.trail(...) on a second thread. The leading thread
+    does the real work and sends what the trailing thread cannot compute
+    itself (loaded values, results of unprotected calls, addresses of its
+    stack slots) and what it has to verify (store addresses and values,
+    branch conditions, call arguments) through one single-producer,
+    single-consumer ring of 64-bit slots. The trailing thread compares
+    them with its own values and exits with 1099, like assert_ft, on the
+    first mismatch.
+
+    Before an unprotected call, which may do I/O, the leading thread waits
+    at a barrier until the trailing one has verified everything before it,
+    so a fault is reported before its effects leave the process. A thread
+    that waits for the other one after that has finished, or for a value
+    while the other waits at a barrier, means the two took different
+    paths; that is reported the same way.
+
+    The ring has one writer and one reader: the leading thread only writes
+    head, the trailing thread only writes tail, and each keeps a cached
+    copy of the other index so that it only touches the other thread's
+    cache line when the ring looks full or empty. Only for single-threaded
+    programs.
+*/
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SRMT_SLOTS (1u << 16)
+#define SRMT_SPINS 256
+
+struct srmt_ring {
+  _Alignas(64) _Atomic uint64_t head;  /* next slot the leading thread fills */
+  uint64_t tailCache;                   /* leading thread's view of tail */
+  _Alignas(64) _Atomic uint64_t tail;  /* next slot the trailing thread reads */
+  uint64_t headCache;                   /* trailing thread's view of head */
+  _Alignas(64) _Atomic uint64_t leadBarriers;
+  _Atomic int leadDone;
+  _Alignas(64) _Atomic uint64_t trailBarriers;
+  _Atomic int trailDone;
+  _Alignas(64) uint64_t slots[SRMT_SLOTS];
+};
+
+static struct srmt_ring ring;
+static pthread_t trailThread;
+
+/* spin for a while, then let the other thread have the core */
+static void srmt_wait(unsigned *spins) {
+  if (++*spins < SRMT_SPINS)
+    return;
+  *spins = 0;
+  sched_yield();
+}
+
+static void srmt_fail(unsigned uid) {
+  printf("**Possible soft-error detected due to data corruption (%d).\n", uid);
+  exit(1099);
+}
+
+static void srmt_diverged(void) {
+  printf("**Possible soft-error detected: the leading and trailing threads took different paths.\n");
+  exit(1099);
+}
+
+/* leading thread */
+void srmt_push(uint64_t v) {
+  uint64_t h = atomic_load_explicit(&ring.head, memory_order_relaxed);
+  unsigned spins = 0;
+  while (h - ring.tailCache == SRMT_SLOTS) {
+    ring.tailCache = atomic_load_explicit(&ring.tail, memory_order_acquire);
+    if (h - ring.tailCache < SRMT_SLOTS)
+      break;
+    /* the trailing thread has finished and will not read any more */
+    if (atomic_load_explicit(&ring.trailDone, memory_order_acquire)) {
+      ring.tailCache = atomic_load_explicit(&ring.tail, memory_order_acquire);
+      if (h - ring.tailCache == SRMT_SLOTS)
+        srmt_diverged();
+      break;
+    }
+    srmt_wait(&spins);
+  }
+  ring.slots[h & (SRMT_SLOTS - 1)] = v;
+  atomic_store_explicit(&ring.head, h + 1, memory_order_release);
+}
+
+/* trailing thread */
+uint64_t srmt_pop(void) {
+  uint64_t t = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+  uint64_t v;
+  unsigned spins = 0;
+  while (t == ring.headCache) {
+    ring.headCache = atomic_load_explicit(&ring.head, memory_order_acquire);
+    if (t != ring.headCache)
+      break;
+    /* the leading thread has finished or waits for us: nothing more comes,
+       unless it was pushed just before */
+    if (atomic_load_explicit(&ring.leadDone, memory_order_acquire) ||
+        atomic_load_explicit(&ring.leadBarriers, memory_order_acquire) >
+            atomic_load_explicit(&ring.trailBarriers, memory_order_relaxed)) {
+      ring.headCache = atomic_load_explicit(&ring.head, memory_order_acquire);
+      if (t == ring.headCache)
+        srmt_diverged();
+      break;
+    }
+    srmt_wait(&spins);
+  }
+  v = ring.slots[t & (SRMT_SLOTS - 1)];
+  atomic_store_explicit(&ring.tail, t + 1, memory_order_release);
+  return v;
+}
+
+void srmt_check(uint64_t mine, unsigned uid) {
+  if (srmt_pop() != mine)
+    srmt_fail(uid);
+}
+
+/* leading thread: returns once the trailing thread got to the same call */
+void srmt_barrier_lead(void) {
+  uint64_t n = atomic_fetch_add_explicit(&ring.leadBarriers, 1, memory_order_release) + 1;
+  unsigned spins = 0;
+  while (atomic_load_explicit(&ring.trailBarriers, memory_order_acquire) < n) {
+    if (atomic_load_explicit(&ring.trailDone, memory_order_acquire) &&
+        atomic_load_explicit(&ring.trailBarriers, memory_order_acquire) < n)
+      srmt_diverged();
+    srmt_wait(&spins);
+  }
+}
+
+/* trailing thread */
+void srmt_barrier_trail(void) {
+  atomic_fetch_add_explicit(&ring.trailBarriers, 1, memory_order_release);
+}
+
+static void *srmt_trail(void *trail) {
+  ((void (*)(void))trail)();
+  atomic_store_explicit(&ring.trailDone, 1, memory_order_release);
+  return NULL;
+}
+
+void srmt_start(void (*trail)(void)) {
+  if (pthread_create(&trailThread, NULL, srmt_trail, (void *)trail) != 0) {
+    fprintf(stderr, "srmt: cannot start the trailing thread\n");
+    exit(1);
+  }
+}
+
+/* leading thread, at the end of main: the trailing thread verifies the rest */
+void srmt_join(void) {
+  atomic_store_explicit(&ring.leadDone, 1, memory_order_release);
+  pthread_join(trailThread, NULL);
+  if (atomic_load_explicit(&ring.tail, memory_order_acquire) !=
+      atomic_load_explicit(&ring.head, memory_order_relaxed))
+    srmt_diverged();
+}
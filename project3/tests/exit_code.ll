@@ -0,0 +1,10 @@
+; A main that only computes its exit code, 42 when run without arguments.
+; O2 finds it readnone, which -srmt's copies must not inherit: the trailing
+; thread's copy would be dropped by -reopt, and nothing checked.
+
+define i32 @main(i32 %argc, i8** %argv) {
+entry:
+  %x = mul i32 %argc, 3
+  %y = add i32 %x, 39
+  ret i32 %y
+}
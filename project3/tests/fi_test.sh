@@ -0,0 +1,72 @@
+#!/usr/bin/env bash
+#
+# fi regression tests on an input whose values are all named, so its
+# disassembly only changes where fi injected:
+#
+#   seed   fi -seed=<n> writes the same bitcode every time
+#   sites  fi -inject-site=<k> changes the k-th instruction -list-sites
+#          prints, and no other fault site
+#
+# USAGE: fi_test.sh <fi> <llvm-dis> <input> seed|sites
+
+set -u
+
+FI=$1
+DIS=$2
+INPUT=$3
+MODE=$4
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+case "$MODE" in
+seed)
+    for run in 1 2; do
+        if ! "$FI" -seed=7 -inject-count=3 "$INPUT" -o "$WORK/$run.bc" > /dev/null; then
+            echo "run $run: fi failed"
+            exit 1
+        fi
+    done
+    if ! cmp -s "$WORK/1.bc" "$WORK/2.bc"; then
+        echo "fi -seed=7 wrote different bitcode on two runs"
+        exit 1
+    fi
+    ;;
+sites)
+    # "<k> <kind> <function>:<instruction>" -> the instruction, as llvm-dis prints it
+    "$FI" -list-sites "$INPUT" -o /dev/null | tail -n +2 | cut -d: -f2- > "$WORK/sites"
+    n=$(wc -l < "$WORK/sites")
+    if [ "$n" = 0 ]; then
+        echo "no fault sites listed"
+        exit 1
+    fi
+    for k in $(seq "$n"); do
+        if ! "$FI" -inject-site="$k" "$INPUT" -o "$WORK/out.bc" > /dev/null ||
+                ! "$DIS" "$WORK/out.bc" -o "$WORK/out.ll"; then
+            echo "site $k: fi failed"
+            exit 1
+        fi
+        j=0
+        while IFS= read -r inst; do
+            j=$((j + 1))
+            if grep -Fxq -- "$inst" "$WORK/out.ll"; then
+                changed=0
+            else
+                changed=1
+            fi
+            if [ "$j" = "$k" ] && [ "$changed" = 0 ]; then
+                echo "-inject-site=$k left the site alone:$inst"
+                exit 1
+            elif [ "$j" != "$k" ] && [ "$changed" = 1 ]; then
+                echo "-inject-site=$k changed site $j:$inst"
+                exit 1
+            fi
+        done < "$WORK/sites"
+    done
+    ;;
+*)
+    echo "unknown mode $MODE"
+    exit 1
+    ;;
+esac
+exit 0
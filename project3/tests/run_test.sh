@@ -0,0 +1,104 @@
+#!/usr/bin/env bash
+#
+# Regression test driver: protects <input> with p3 [flags], builds it with
+# llc and cc, runs it and compares the run with the golden one, the input
+# built with p3 -no-swft.
+#
+#   <expect> golden   same output and exit code as the golden run
+#   <expect> <code>   exit code <code> (as the shell sees it, & 0xff),
+#                     e.g. 1099 for a check that caught a fault
+#
+# Options, before the p3 flags:
+#   -fault=<regex>   inject a fault with fi -inject-site into the first
+#                    site fi -list-sites prints that matches <regex>
+#   -link=<arg>      also pass <arg> to cc, for runtimes the program needs
+#   -votes           build with -tmr-votes and expect the run to have
+#                    counted an outvoted copy
+#
+# USAGE: run_test.sh <p3> <fi> <llc> <cc> <input> <expect> [options] [p3 flags]...
+
+set -u
+
+P3=$1
+FI=$2
+LLC=$3
+CC=$4
+INPUT=$5
+EXPECT=$6
+shift 6
+
+FAULT=""
+LINK=()
+VOTES=0
+while [ $# -gt 0 ]; do
+    case "$1" in
+        -fault=*) FAULT=${1#-fault=} ;;
+        -link=*) LINK+=("${1#-link=}") ;;
+        -votes) VOTES=1 ;;
+        *) break ;;
+    esac
+    shift
+done
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+FLAGS=("$@")
+if [ "$VOTES" = 1 ]; then
+    FLAGS+=("-tmr-votes=$WORK/votes")
+fi
+
+# build <bitcode> into <exe>
+build() {
+    "$LLC" -O2 -relocation-model=pic "$1" -o "$WORK/$2.s" &&
+        "$CC" "$WORK/$2.s" -o "$WORK/$2" "${LINK[@]}" -lm
+}
+
+if ! "$P3" -no-swft "$INPUT" "$WORK/golden.bc" > /dev/null || ! build "$WORK/golden.bc" golden; then
+    echo "golden build failed"
+    exit 1
+fi
+timeout 20 "$WORK/golden" > "$WORK/golden.out"
+golden=$?
+
+if ! "$P3" "${FLAGS[@]}" "$INPUT" "$WORK/out.bc" > /dev/null; then
+    echo "p3 failed"
+    exit 1
+fi
+if [ -n "$FAULT" ]; then
+    site=$("$FI" -list-sites "$WORK/out.bc" -o /dev/null | grep -E -m1 "$FAULT" | cut -d' ' -f1)
+    if [ -z "$site" ]; then
+        echo "no fault site matches '$FAULT'"
+        exit 1
+    fi
+    if ! "$FI" -inject-site="$site" "$WORK/out.bc" -o "$WORK/fi.bc" > /dev/null; then
+        echo "fi failed"
+        exit 1
+    fi
+    mv "$WORK/fi.bc" "$WORK/out.bc"
+fi
+if ! build "$WORK/out.bc" out; then
+    echo "build failed"
+    exit 1
+fi
+timeout 20 "$WORK/out" > "$WORK/out.out"
+rc=$?
+
+if [ "$EXPECT" = golden ]; then
+    if [ "$rc" != "$golden" ] || ! cmp -s "$WORK/golden.out" "$WORK/out.out"; then
+        echo "exit code $rc, output:"
+        cat "$WORK/out.out"
+        echo "expected exit code $golden, output:"
+        cat "$WORK/golden.out"
+        exit 1
+    fi
+elif [ "$rc" != $((EXPECT & 0xff)) ]; then
+    echo "exit code $rc, expected $EXPECT ($((EXPECT & 0xff)))"
+    exit 1
+fi
+
+if [ "$VOTES" = 1 ] && ! grep -q " [1-9][0-9]*$" "$WORK/votes" 2> /dev/null; then
+    echo "no vote outvoted a copy"
+    exit 1
+fi
+exit 0
@@ -0,0 +1,34 @@
+; Weighted sum of @data, run by the p3 tests. The number of elements comes
+; from argc so O2 cannot fold the loop away: the program prints 162, keeps
+; it in @total and exits with 162 - 128.
+
+@.str = private unnamed_addr constant [4 x i8] c"%d\0A\00"
+@data = global [8 x i32] [i32 3, i32 1, i32 4, i32 1, i32 5, i32 9, i32 2, i32 6]
+@total = global i32 0
+
+declare i32 @printf(i8*, ...)
+
+define i32 @main(i32 %argc, i8** %argv) {
+entry:
+  %n = add i32 %argc, 7
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %loop ]
+  %sum = phi i32 [ 0, %entry ], [ %acc, %loop ]
+  %idx = zext i32 %i to i64
+  %p = getelementptr [8 x i32], [8 x i32]* @data, i64 0, i64 %idx
+  %v = load volatile i32, i32* %p
+  %next = add i32 %i, 1
+  %weighted = mul i32 %v, %next
+  %acc = add i32 %sum, %weighted
+  %more = icmp slt i32 %next, %n
+  br i1 %more, label %loop, label %done
+
+done:
+  store i32 %acc, i32* @total
+  %out = load volatile i32, i32* @total
+  %call = call i32 (i8*, ...) @printf(i8* getelementptr ([4 x i8], [4 x i8]* @.str, i64 0, i64 0), i32 %out)
+  %code = sub i32 %acc, 128
+  ret i32 %code
+}